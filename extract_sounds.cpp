@@ -1,9 +1,11 @@
 // Super Mario 64 PC Port's audio asset extractor and converter, translated from mixed
 // Python, Make and C to C++
 
-// g++ -o extract_sounds extract_sounds.cpp -std=c++20 -laudiofile -Wall -Wextra
+// g++ -o extract_sounds extract_sounds.cpp -std=c++20 -pthread -Wall -Wextra
 // cp /path/to/baserom.us.z64 baserom.us.z64
-// ./extract_sounds
+// ./extract_sounds [--jobs N] [--frame-tries N] [--frame-time MS] [--kernels scalar|sse4.1|avx2]
+//                  [--cache-dir DIR] [--cache-size MB] [--no-cache] [--force] [--stream-tables]
+//                  [--table-order N] [--table-bits N] [--table-iters N] [--self-test]
 // US ROM only
 // first, it extracts all necessary sound/sequences/us/*.m64 and sound/samples/*/*.aiff files
 // then, converts all sound/samples/*/*.aiff files to sound/samples/*/*.table files // TODO: rest of the
@@ -16,24 +18,48 @@
 // sound/sound_banks/ folders into the remaining two "game-ready" sound asset files, sound/sequences.bin
 // and sound/bank_sets
 
+#include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <mutex>
+#include <numeric>
 #include <set>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <regex>
 
 #include <cassert>
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
 
-#include <audiofile.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
 
 using namespace std;
 namespace fs = filesystem;
@@ -41,49 +67,105 @@ namespace fs = filesystem;
 // Asset maps containing purely address information of where the files are in the ROM relative
 // to various reference points that are calculated within the extraction logic below them
 // and associates those addresses with the filenames and folder structure chosen by the decompilation
-// team and adjusted by later teams for cross-platform ports
-map<const string, const vector<uint32_t>> sequence_map = {
-    { "sound/sequences/us/01_cutscene_collect_star.m64", { 619, 8076816 } },
-    { "sound/sequences/us/02_menu_title_screen.m64", { 8254, 8077440 } },
-    { "sound/sequences/us/03_level_grass.m64", { 5122, 8085696 } },
-    { "sound/sequences/us/04_level_inside_castle.m64", { 2494, 8090832 } },
-    { "sound/sequences/us/05_level_water.m64", { 4780, 8093328 } },
-    { "sound/sequences/us/06_level_hot.m64", { 2451, 8098112 } },
-    { "sound/sequences/us/07_level_boss_koopa.m64", { 3418, 8100576 } },
-    { "sound/sequences/us/08_level_snow.m64", { 8143, 8104000 } },
-    { "sound/sequences/us/09_level_slide.m64", { 7432, 8112144 } },
-    { "sound/sequences/us/0A_level_spooky.m64", { 5674, 8119584 } },
-    { "sound/sequences/us/0B_event_piranha_plant.m64", { 1395, 8125264 } },
-    { "sound/sequences/us/0C_level_underground.m64", { 4887, 8126672 } },
-    { "sound/sequences/us/0D_menu_star_select.m64", { 134, 8131568 } },
-    { "sound/sequences/us/0E_event_powerup.m64", { 3129, 8131712 } },
-    { "sound/sequences/us/0F_event_metal_cap.m64", { 2770, 8134848 } },
-    { "sound/sequences/us/10_event_koopa_message.m64", { 552, 8137632 } },
-    { "sound/sequences/us/11_level_koopa_road.m64", { 4741, 8138192 } },
-    { "sound/sequences/us/12_event_high_score.m64", { 271, 8142944 } },
-    { "sound/sequences/us/13_event_merry_go_round.m64", { 1657, 8143216 } },
-    { "sound/sequences/us/14_event_race.m64", { 197, 8144880 } },
-    { "sound/sequences/us/15_cutscene_star_spawn.m64", { 644, 8145088 } },
-    { "sound/sequences/us/16_event_boss.m64", { 3435, 8145744 } },
-    { "sound/sequences/us/17_cutscene_collect_key.m64", { 671, 8149184 } },
-    { "sound/sequences/us/18_event_endless_stairs.m64", { 1777, 8149856 } },
-    { "sound/sequences/us/19_level_boss_koopa_final.m64", { 3515, 8151648 } },
-    { "sound/sequences/us/1A_cutscene_credits.m64", { 14313, 8155168 } },
-    { "sound/sequences/us/1B_event_solve_puzzle.m64", { 216, 8169488 } },
-    { "sound/sequences/us/1C_event_toad_message.m64", { 208, 8169712 } },
-    { "sound/sequences/us/1D_event_peach_message.m64", { 432, 8169920 } },
-    { "sound/sequences/us/1E_cutscene_intro.m64", { 1764, 8170352 } },
-    { "sound/sequences/us/1F_cutscene_victory.m64", { 2058, 8172128 } },
-    { "sound/sequences/us/20_cutscene_ending.m64", { 1882, 8174192 } },
-    { "sound/sequences/us/21_menu_file_select.m64", { 781, 8176080 } },
-    { "sound/sequences/us/22_cutscene_lakitu.m64", { 313, 8176864 } },
+// team and adjusted by later teams for cross-platform ports. They are constexpr arrays of string_views,
+// so they cost nothing at startup and looking them up never changes them.
+struct RomAsset {
+    string_view filename;
+    uint32_t size, offset;
+};
+
+struct SampleAsset {
+    uint32_t address;
+    string_view filename;
 };
 
-map<const string, const vector<uint32_t>> seqfile_map = {
-    { "ctl", { 97856, 5748512 } },
-    { "tbl", { 2216704, 5846368 } },
+// AddressTable
+// Filenames by sample address in a hash table that is filled in at compile time. Probing stops at the
+// first empty slot, and a table at most half full keeps that to a slot or two.
+class AddressTable {
+  public:
+    template <size_t N, size_t SLOTS>
+    constexpr AddressTable(const SampleAsset (&assets)[N], const array<uint16_t, SLOTS> &slots)
+        : assets(assets), slots(slots) {
+    }
+
+    template <size_t N> static consteval auto build(const SampleAsset (&assets)[N]) {
+        array<uint16_t, bit_ceil(2 * N)> slots;
+        slots.fill(EMPTY);
+        for (size_t i = 0; i < N; i++) {
+            size_t slot = hash(assets[i].address, slots.size());
+            while (slots[slot] != EMPTY) {
+                assert(assets[slots[slot]].address != assets[i].address);
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = i;
+        }
+        return slots;
+    }
+
+    // The filename of the sample at `address`, or an empty one if no sample is known there
+    constexpr string_view operator[](uint32_t address) const {
+        for (size_t slot = hash(address, slots.size()); slots[slot] != EMPTY;
+             slot = (slot + 1) & (slots.size() - 1)) {
+            if (assets[slots[slot]].address == address) {
+                return assets[slots[slot]].filename;
+            }
+        }
+        return {};
+    }
+
+  private:
+    static constexpr uint16_t EMPTY = UINT16_MAX;
+
+    span<const SampleAsset> assets;
+    span<const uint16_t> slots;
+
+    static constexpr size_t hash(uint32_t address, size_t size) {
+        return static_cast<uint32_t>(address * 0x9E3779B1u) >> (32 - countr_zero(size));
+    }
+};
+// End AddressTable
+
+constexpr RomAsset sequence_map[] = {
+    { "sound/sequences/us/01_cutscene_collect_star.m64", 619, 8076816 },
+    { "sound/sequences/us/02_menu_title_screen.m64", 8254, 8077440 },
+    { "sound/sequences/us/03_level_grass.m64", 5122, 8085696 },
+    { "sound/sequences/us/04_level_inside_castle.m64", 2494, 8090832 },
+    { "sound/sequences/us/05_level_water.m64", 4780, 8093328 },
+    { "sound/sequences/us/06_level_hot.m64", 2451, 8098112 },
+    { "sound/sequences/us/07_level_boss_koopa.m64", 3418, 8100576 },
+    { "sound/sequences/us/08_level_snow.m64", 8143, 8104000 },
+    { "sound/sequences/us/09_level_slide.m64", 7432, 8112144 },
+    { "sound/sequences/us/0A_level_spooky.m64", 5674, 8119584 },
+    { "sound/sequences/us/0B_event_piranha_plant.m64", 1395, 8125264 },
+    { "sound/sequences/us/0C_level_underground.m64", 4887, 8126672 },
+    { "sound/sequences/us/0D_menu_star_select.m64", 134, 8131568 },
+    { "sound/sequences/us/0E_event_powerup.m64", 3129, 8131712 },
+    { "sound/sequences/us/0F_event_metal_cap.m64", 2770, 8134848 },
+    { "sound/sequences/us/10_event_koopa_message.m64", 552, 8137632 },
+    { "sound/sequences/us/11_level_koopa_road.m64", 4741, 8138192 },
+    { "sound/sequences/us/12_event_high_score.m64", 271, 8142944 },
+    { "sound/sequences/us/13_event_merry_go_round.m64", 1657, 8143216 },
+    { "sound/sequences/us/14_event_race.m64", 197, 8144880 },
+    { "sound/sequences/us/15_cutscene_star_spawn.m64", 644, 8145088 },
+    { "sound/sequences/us/16_event_boss.m64", 3435, 8145744 },
+    { "sound/sequences/us/17_cutscene_collect_key.m64", 671, 8149184 },
+    { "sound/sequences/us/18_event_endless_stairs.m64", 1777, 8149856 },
+    { "sound/sequences/us/19_level_boss_koopa_final.m64", 3515, 8151648 },
+    { "sound/sequences/us/1A_cutscene_credits.m64", 14313, 8155168 },
+    { "sound/sequences/us/1B_event_solve_puzzle.m64", 216, 8169488 },
+    { "sound/sequences/us/1C_event_toad_message.m64", 208, 8169712 },
+    { "sound/sequences/us/1D_event_peach_message.m64", 432, 8169920 },
+    { "sound/sequences/us/1E_cutscene_intro.m64", 1764, 8170352 },
+    { "sound/sequences/us/1F_cutscene_victory.m64", 2058, 8172128 },
+    { "sound/sequences/us/20_cutscene_ending.m64", 1882, 8174192 },
+    { "sound/sequences/us/21_menu_file_select.m64", 781, 8176080 },
+    { "sound/sequences/us/22_cutscene_lakitu.m64", 313, 8176864 },
 };
 
+constexpr RomAsset ctl_seqfile = { "ctl", 97856, 5748512 };
+constexpr RomAsset tbl_seqfile = { "tbl", 2216704, 5846368 };
+
 // I made a new map of the .aiff filenames to the ROM addresses that I think is better. previously the
 // only information conveyed by the asset map was a convoluted index of what order the assets were in.
 // That caused a problem for me because some samples are shared between multiple sample banks, causing
@@ -96,9 +178,9 @@ map<const string, const vector<uint32_t>> seqfile_map = {
 // there are indeed a few samples with the exact same length. Maybe it would be better to calculate an
 // md5sum hash of some part of each sample to identify it, but I choose to follow the example used by
 // the .m64 section. The start of the data specific to each aiff file is calculated based on an offset
-// from the ctl[1] value in the seqfile_map right above this, 5748512, so each of these addresses is
+// from the offset of ctl_seqfile right above this, 5748512, so each of these addresses is
 // relative to that address, 5748512.
-map<const uint32_t, const string> sample_map = {
+constexpr SampleAsset sample_assets[] = {
     { 352, "sound/samples/sfx_1/00_twirl.aiff" },
     { 480, "sound/samples/sfx_1/01_brushing.aiff" },
     { 640, "sound/samples/sfx_1/02_hand_touch.aiff" },
@@ -320,6 +402,9 @@ map<const uint32_t, const string> sample_map = {
     { 90416, "sound/samples/bowser_organ/02_boys_choir.aiff" },
 };
 
+constexpr auto sample_slots = AddressTable::build(sample_assets);
+constexpr AddressTable sample_map(sample_assets, sample_slots);
+
 const uint16_t TYPE_CTL = 1;
 const uint16_t TYPE_TBL = 2;
 // End asset map
@@ -346,24 +431,11 @@ const uint16_t TYPE_TBL = 2;
         destbytes[addr + 3] = static_cast<byte>(val & 0xFF);                                           \
     }
 
-#define INTO_BYTES ([](char c) { return static_cast<byte>(c); })
-
 size_t align(const size_t size, const size_t alignment) {
     return static_cast<size_t>((static_cast<int>(size) + (static_cast<int>(alignment) - 1))
                                & -static_cast<int>(alignment));
 }
 
-vector<byte> pstring(const string &data_string) {
-    uint32_t length = data_string.size();
-    vector<byte> data(length + 1);
-    data[0] = static_cast<byte>(length);
-    transform(data_string.begin(), data_string.end(), data.begin() + 1, INTO_BYTES);
-    if (!(length % 2)) {
-        data.push_back(static_cast<byte>('\0'));
-    }
-    return data;
-}
-
 vector<byte> serialize_f80(const double num) {
     uint64_t f64 = bit_cast<uint64_t>(num);
     uint64_t f64_sign_bit = f64 & (1ULL << 63);
@@ -392,6 +464,534 @@ vector<byte> serialize_f80(const double num) {
     return result;
 }
 
+// MappedFile
+// Read-only view over a whole input file. Regular files are mapped straight into memory and read
+// through the page cache with no copy; pipes, character devices and anything else that refuses to
+// be mapped are read into an owned buffer in large blocks instead. Either way the contents are
+// exposed as a single span that stays valid for the lifetime of the object.
+class MappedFile {
+  public:
+    MappedFile(const string &filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    explicit operator bool() const {
+        return is_open;
+    }
+
+    span<const byte> bytes() const {
+        return view;
+    }
+
+  private:
+    bool is_open = false;
+    void *map_addr = MAP_FAILED;
+    size_t map_size = 0;
+    vector<byte> buffer;
+    span<const byte> view;
+};
+
+MappedFile::MappedFile(const string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular && st.st_size > 0) {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            // every stage walks the image front to back, so ask for aggressive readahead
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            madvise(addr, st.st_size, MADV_WILLNEED);
+            map_addr = addr;
+            map_size = st.st_size;
+            view = span<const byte>(static_cast<const byte *>(addr), map_size);
+            is_open = true;
+            close(fd);
+            return;
+        }
+    }
+
+    // Buffered fallback
+    const size_t block_size = 1 << 16;
+    if (regular) {
+        buffer.reserve(st.st_size);
+    }
+    for (;;) {
+        size_t used = buffer.size();
+        buffer.resize(used + block_size);
+        ssize_t got = read(fd, buffer.data() + used, block_size);
+        if (got < 0 && errno == EINTR) {
+            buffer.resize(used);
+            continue;
+        }
+        if (got <= 0) {
+            buffer.resize(used);
+            is_open = got == 0;
+            break;
+        }
+        buffer.resize(used + got);
+    }
+    close(fd);
+    view = span<const byte>(buffer);
+}
+
+MappedFile::~MappedFile() {
+    if (map_addr != MAP_FAILED) {
+        munmap(map_addr, map_size);
+    }
+}
+// End MappedFile
+
+// ThreadPool
+// Fixed set of worker threads that run parallel_for() batches. Indices are handed out in order, in
+// chunks of `grain`, and the calling thread always works on its own batch, so a parallel_for()
+// issued from inside a worker (a frame-level loop inside a sample-level one) still makes progress
+// when every other thread is busy. Idle workers help with whichever batch was opened first.
+class ThreadPool {
+  public:
+    ThreadPool(const unsigned threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void parallel_for(const size_t count, const function<void(size_t)> &body, size_t grain = 1);
+
+    unsigned size() const {
+        return workers.size() + 1;
+    }
+
+  private:
+    struct Batch {
+        const function<void(size_t)> *body;
+        size_t count, grain, next = 0, done = 0;
+    };
+
+    bool run_chunk(unique_lock<mutex> &held, Batch &batch);
+    void worker_loop(void);
+
+    vector<thread> workers;
+    deque<Batch *> open_batches;
+    mutex lock;
+    condition_variable wake, finished;
+    bool stopping = false;
+};
+
+ThreadPool::ThreadPool(const unsigned threads) {
+    for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> held(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+// Claims the next chunk of `batch` and runs it with the lock released. Returns false once every
+// index of the batch has been claimed.
+bool ThreadPool::run_chunk(unique_lock<mutex> &held, Batch &batch) {
+    if (batch.next == batch.count) {
+        return false;
+    }
+    size_t begin = batch.next, end = min(batch.count, begin + batch.grain);
+    batch.next = end;
+    if (batch.next == batch.count) {
+        erase(open_batches, &batch);
+    }
+
+    held.unlock();
+    for (size_t i = begin; i < end; i++) {
+        (*batch.body)(i);
+    }
+    held.lock();
+
+    batch.done += end - begin;
+    if (batch.done == batch.count) {
+        finished.notify_all();
+    }
+    return true;
+}
+
+void ThreadPool::worker_loop(void) {
+    unique_lock<mutex> held(lock);
+    for (;;) {
+        wake.wait(held, [this] { return stopping || !open_batches.empty(); });
+        if (stopping) {
+            return;
+        }
+        run_chunk(held, *open_batches.front());
+    }
+}
+
+void ThreadPool::parallel_for(const size_t count, const function<void(size_t)> &body, size_t grain) {
+    if (workers.empty() || count <= grain) {
+        for (size_t i = 0; i < count; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    Batch batch = { &body, count, max<size_t>(grain, 1) };
+    unique_lock<mutex> held(lock);
+    open_batches.push_back(&batch);
+    wake.notify_all();
+    while (run_chunk(held, batch)) {
+    }
+    finished.wait(held, [&batch] { return batch.done == batch.count; });
+}
+// End ThreadPool
+
+// Writes all of `iov` to `fd`, retrying on EINTR and after partial writes. Returns 0 or the errno.
+int write_fully(int fd, iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return errno;
+        }
+        // Partial write, resume after the last byte that made it
+        for (; count > 0 && static_cast<size_t>(written) >= iov->iov_len; iov++, count--) {
+            written -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<byte *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Bump whenever the bytes of any generated file change, so that nothing produced by an older build
+// is reused
+const uint32_t OUTPUT_VERSION = 1;
+
+// Fast non-cryptographic hash over 8-byte words, finished with the splitmix64 finalizer. Only used
+// to recognise inputs that were seen before, never for anything adversarial.
+uint64_t hash_bytes(span<const byte> data, uint64_t seed) {
+    const uint64_t k1 = 0x9e3779b97f4a7c15ULL, k2 = 0xbf58476d1ce4e5b9ULL;
+    uint64_t h = seed ^ (data.size() * k1), word;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        memcpy(&word, data.data() + i, 8);
+        h = rotl(h ^ (word * k1), 31) * k2;
+    }
+    word = 0;
+    memcpy(&word, data.data() + i, data.size() - i);
+    h = rotl(h ^ (word * k1), 31) * k2;
+    h = (h ^ (h >> 30)) * k2;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// 128-bit digest of everything a generated file depends on, built from two independently seeded
+// hash_bytes() chains
+struct CacheKey {
+    uint64_t words[2] = { 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL };
+
+    void add(span<const byte> data) {
+        words[0] = hash_bytes(data, words[0]);
+        words[1] = hash_bytes(data, ~words[1]);
+    }
+
+    template <typename T> void add_value(const T &value) {
+        add(as_bytes(span(&value, 1)));
+    }
+
+    string hex(void) const {
+        char out[33];
+        snprintf(out, sizeof(out), "%016llx%016llx", static_cast<unsigned long long>(words[0]),
+                 static_cast<unsigned long long>(words[1]));
+        return out;
+    }
+
+    bool operator==(const CacheKey &other) const = default;
+};
+
+// ArtifactCache
+// Directory of generated files named by their CacheKey. Every entry starts with a header repeating
+// the key, the payload size and a checksum of the payload, and is only used when all of them check
+// out; anything else counts as a miss and is deleted. Entries are written to a temporary name and
+// renamed into place, so concurrent writers (threads or separate runs) never expose a partial file.
+// trim() evicts the least recently used entries once the directory grows past its size limit.
+class ArtifactCache {
+  public:
+    // An empty `dir` disables the cache: load() always misses and store() does nothing
+    ArtifactCache(const fs::path &dir, uintmax_t max_bytes);
+
+    explicit operator bool() const {
+        return !dir.empty();
+    }
+
+    // A hit hands the payload to `use` straight out of the mapped entry, before returning true
+    bool load(const CacheKey &key, const function<void(span<const byte>)> &use) const;
+    void store(const CacheKey &key, span<const byte> head, span<const byte> tail = {}) const;
+    void trim(void) const;
+
+  private:
+    struct EntryHeader {
+        char magic[8];
+        uint32_t version, reserved;
+        CacheKey key;
+        // The payload is stored as the two pieces it was handed over in, and checksummed that way
+        uint64_t head_size, size, checksum;
+    };
+
+    fs::path dir;
+    uintmax_t max_bytes;
+
+    fs::path entry_path(const CacheKey &key) const {
+        return dir / (key.hex() + ".bin");
+    }
+};
+
+ArtifactCache::ArtifactCache(const fs::path &dir, uintmax_t max_bytes)
+    : dir(dir), max_bytes(max_bytes) {
+    error_code err;
+    if (!this->dir.empty() && !fs::create_directories(this->dir, err) && !fs::is_directory(this->dir)) {
+        cerr << "Cache directory " << this->dir.string() << " is unusable, continuing without it: "
+             << err.message() << endl;
+        this->dir.clear();
+    }
+}
+
+bool ArtifactCache::load(const CacheKey &key, const function<void(span<const byte>)> &use) const {
+    if (dir.empty()) {
+        return false;
+    }
+
+    auto path = entry_path(key);
+    auto file = MappedFile(path.string());
+    if (!file) {
+        return false;
+    }
+
+    auto data = file.bytes();
+    EntryHeader header;
+    bool valid = data.size() >= sizeof(header);
+    if (valid) {
+        memcpy(&header, data.data(), sizeof(header));
+        auto payload = data.subspan(sizeof(header));
+        valid = memcmp(header.magic, "SNDCACHE", 8) == 0 && header.version == OUTPUT_VERSION
+                && header.key == key && header.size == payload.size() && header.head_size <= header.size
+                && header.checksum
+                       == hash_bytes(payload.subspan(header.head_size),
+                                     hash_bytes(payload.first(header.head_size), 0));
+    }
+    error_code err;
+    if (!valid) {
+        fs::remove(path, err);
+        return false;
+    }
+
+    use(data.subspan(sizeof(header)));
+    // Hits count as uses for trim()
+    fs::last_write_time(path, fs::file_time_type::clock::now(), err);
+    return true;
+}
+
+void ArtifactCache::store(const CacheKey &key, span<const byte> head, span<const byte> tail) const {
+    if (dir.empty()) {
+        return;
+    }
+
+    EntryHeader header = {};
+    memcpy(header.magic, "SNDCACHE", 8);
+    header.version = OUTPUT_VERSION;
+    header.key = key;
+    header.head_size = head.size();
+    header.size = head.size() + tail.size();
+    header.checksum = hash_bytes(tail, hash_bytes(head, 0));
+
+    auto path = entry_path(key);
+    ostringstream temp_name;
+    temp_name << path.string() << ".tmp." << getpid() << "." << this_thread::get_id();
+    string temp_path = temp_name.str();
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return;
+    }
+    iovec iov[3] = {
+        { &header, sizeof(header) },
+        { const_cast<byte *>(head.data()), head.size() },
+        { const_cast<byte *>(tail.data()), tail.size() },
+    };
+    bool ok = write_fully(fd, iov, 3) == 0;
+    ok = close(fd) == 0 && ok;
+    error_code err;
+    if (ok) {
+        fs::rename(temp_path, path, err);
+    }
+    if (!ok || err) {
+        fs::remove(temp_path, err);
+    }
+}
+
+void ArtifactCache::trim(void) const {
+    if (dir.empty()) {
+        return;
+    }
+
+    vector<tuple<fs::file_time_type, uintmax_t, fs::path>> entries;
+    uintmax_t total = 0;
+    error_code err;
+    for (auto it = fs::directory_iterator(dir, err); !err && it != fs::directory_iterator();
+         it.increment(err)) {
+        error_code entry_err;
+        if (it->path().extension() != ".bin" || !it->is_regular_file(entry_err)) {
+            continue;
+        }
+        uintmax_t size = it->file_size(entry_err);
+        auto time = it->last_write_time(entry_err);
+        if (!entry_err) {
+            entries.emplace_back(time, size, it->path());
+            total += size;
+        }
+    }
+
+    sort(entries.begin(), entries.end());
+    for (const auto &[time, size, path] : entries) {
+        if (total <= max_bytes) {
+            break;
+        }
+        if (fs::remove(path, err)) {
+            total -= size;
+        }
+    }
+}
+
+// $XDG_CACHE_HOME/extract_sounds, else ~/.cache/extract_sounds, else no cache at all
+fs::path default_cache_dir(void) {
+    if (const char *xdg = getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0') {
+        return fs::path(xdg) / "extract_sounds";
+    }
+    if (const char *home = getenv("HOME"); home != nullptr && *home != '\0') {
+        return fs::path(home) / ".cache" / "extract_sounds";
+    }
+    return fs::path();
+}
+// End ArtifactCache
+
+// Manifest
+// Remembers what every generated file was made from: the key of its inputs (ROM bytes or source file
+// contents, plus OUTPUT_VERSION) and the size it came out at. A later run that finds the same key and
+// an intact file leaves that file alone, so its timestamp doesn't wake up downstream builds. Outputs
+// that aren't produced or confirmed again are dropped when the manifest is saved.
+class Manifest {
+  public:
+    // A missing or unreadable manifest, or `ignore_previous`, makes every output look out of date
+    Manifest(const fs::path &path, bool ignore_previous);
+
+    bool up_to_date(const string &output, const CacheKey &key);
+    void record(const string &output, const CacheKey &key);
+    int save(void) const;
+
+  private:
+    struct Entry {
+        CacheKey key;
+        uintmax_t size;
+    };
+
+    fs::path path;
+    map<string, Entry> previous;
+    mutable mutex lock;
+    map<string, Entry> current;
+
+    static string normalize(const string &output) {
+        fs::path out = fs::path(output).lexically_normal();
+        return (out.is_absolute() ? out.lexically_relative(fs::current_path()) : out).generic_string();
+    }
+};
+
+const char *const MANIFEST_HEADER = "extract_sounds manifest 1";
+
+Manifest::Manifest(const fs::path &path, bool ignore_previous) : path(path) {
+    auto in = ifstream(path);
+    string line;
+    if (ignore_previous || !in || !getline(in, line) || line != MANIFEST_HEADER) {
+        return;
+    }
+    while (getline(in, line)) {
+        // <key> <size> <path>, the path taking up the rest of the line
+        Entry entry;
+        unsigned long long words[2], size;
+        int consumed = 0;
+        if (sscanf(line.c_str(), "%16llx%16llx %llu %n", &words[0], &words[1], &size, &consumed) != 3
+            || consumed == 0) {
+            previous.clear();
+            return;
+        }
+        entry.key.words[0] = words[0];
+        entry.key.words[1] = words[1];
+        entry.size = size;
+        previous[line.substr(consumed)] = entry;
+    }
+}
+
+bool Manifest::up_to_date(const string &output, const CacheKey &key) {
+    string name = normalize(output);
+    auto it = previous.find(name);
+    error_code err;
+    if (it == previous.end() || !(it->second.key == key)
+        || fs::file_size(output, err) != it->second.size || err) {
+        return false;
+    }
+    lock_guard<mutex> held(lock);
+    current[name] = it->second;
+    return true;
+}
+
+void Manifest::record(const string &output, const CacheKey &key) {
+    error_code err;
+    uintmax_t size = fs::file_size(output, err);
+    if (err) {
+        return;
+    }
+    lock_guard<mutex> held(lock);
+    current[normalize(output)] = { key, size };
+}
+
+int Manifest::save(void) const {
+    string temp_path = path.string() + ".tmp";
+    {
+        auto out = ofstream(temp_path);
+        if (!out) {
+            cerr << "Failed to open: " << temp_path << "!" << endl;
+            return 1;
+        }
+        lock_guard<mutex> held(lock);
+        out << MANIFEST_HEADER << endl;
+        for (const auto &[name, entry] : current) {
+            out << entry.key.hex() << " " << entry.size << " " << name << "\n";
+        }
+        if (!out.flush()) {
+            cerr << "Failed to write: " << temp_path << "!" << endl;
+            return 1;
+        }
+    }
+    error_code err;
+    fs::rename(temp_path, path, err);
+    if (err) {
+        cerr << "Failed to write: " << path.string() << ": " << err.message() << endl;
+        return 1;
+    }
+    return 0;
+}
+// End Manifest
+
 // aifc_decode.c translated into C++
 /**
  * Bruteforcing decoder for converting ADPCM-encoded AIFC into AIFF, in a way
@@ -401,6 +1001,7 @@ vector<byte> serialize_f80(const double num) {
 typedef signed char s8;
 typedef short s16;
 typedef int s32;
+typedef long long s64;
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
@@ -425,14 +1026,7 @@ typedef float f32;
 
 #define NORETURN __attribute__((noreturn))
 #define UNUSED __attribute__((unused))
-
-typedef struct {
-    u32 ckID, ckSize;
-} ChunkHeader;
-
-typedef struct {
-    u32 ckID, ckSize, formType;
-} Chunk;
+#define TARGET(isa) __attribute__((target(isa)))
 
 typedef struct {
     s16 numChannels;
@@ -473,14 +1067,15 @@ class ALADPCMLoop {
     ALADPCMLoop(const uint32_t start, const uint32_t end, const uint32_t count,
                 const vector<int16_t> &state);
     ALADPCMLoop(const ALADPCMLoop &l);
-    ALADPCMLoop(const uint32_t addr, const vector<byte> &bank_data);
+    ALADPCMLoop(ALADPCMLoop &&l) = default;
+    ALADPCMLoop(const uint32_t addr, span<const byte> bank_data);
     ALADPCMLoop() = default;
 
     ALADPCMLoop &operator=(const ALADPCMLoop &loop) = default;
 };
 // End shared class declaration
 
-size_t read_bytes_from_vec(void *ptr, size_t size, size_t count, const vector<byte> &buffer,
+size_t read_bytes_from_vec(void *ptr, size_t size, size_t count, span<const byte> buffer,
                            size_t *offset) {
     size_t bytes_to_read = size * count;
     size_t bytes_available = buffer.size() - *offset;
@@ -510,11 +1105,23 @@ size_t write_bytes_to_vec(const void *ptr, size_t size, size_t count, vector<byt
     return bytes_to_write / size;
 }
 
-s32 myrand() {
-    static u64 state = 1619236481962341ULL;
-    state *= 3123692312231ULL;
-    state++;
-    return state >> 33;
+// The generator state used to be a function-local static. Every frame now carries its own, seeded
+// from the frame's position in the sample, so a sample decodes to the same bytes no matter which
+// thread runs which frame or what was decoded before it.
+const u64 MYRAND_SEED = 1619236481962341ULL;
+
+u64 myrand_seed(u64 frame) {
+    // splitmix64 finalizer, so neighbouring frames don't start on correlated LCG sequences
+    u64 z = MYRAND_SEED + frame * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+s32 myrand(u64 *state) {
+    *state *= 3123692312231ULL;
+    (*state)++;
+    return *state >> 33;
 }
 
 s16 qsample(s32 x, s32 scale) {
@@ -542,82 +1149,109 @@ s32 toi4(s32 x) {
     return x;
 }
 
-s32 read_aifc_codebook(const vector<byte> &aifcData, size_t *fhandle,
-                       vector<vector<vector<s32>>> &table, s16 *order, s16 *npredictors) {
-    read_bytes_from_vec(order, sizeof(s16), 1, aifcData, fhandle);
-    BSWAP16(*order);
-    read_bytes_from_vec(npredictors, sizeof(s16), 1, aifcData, fhandle);
-    BSWAP16(*npredictors);
-    table.resize(*npredictors * sizeof(s32 **));
-    for (s32 i = 0; i < *npredictors; i++) {
-        table[i].resize(8 * sizeof(s32 *));
-        for (s32 j = 0; j < 8; j++) {
-            table[i][j].resize((*order + 8) * sizeof(s32));
-        }
-    }
+// One predictor of a codebook laid out for the SIMD kernels. Column c holds coefficient c of each of
+// the 8 rows of a half-frame, so a row-by-row inner product becomes a sum of scaled columns.
+// Coefficients that inner_product() leaves out, i.e. c >= order + row, are zeroed. Each one fills
+// exactly 8 cache lines.
+struct alignas(64) PredictorMatrix {
+    s32 cols[16][8];
+};
 
-    for (s32 i = 0; i < *npredictors; i++) {
-        vector<vector<s32>> *table_entry = &table[i];
-        for (s32 j = 0; j < *order; j++) {
-            for (s32 k = 0; k < 8; k++) {
-                s16 ts;
-                read_bytes_from_vec(&ts, sizeof(s16), 1, aifcData, fhandle);
-                BSWAP16(ts);
-                (*table_entry)[k][j] = ts;
+// A VADPCM codebook, expanded once into what the encoder and decoder read. Each predictor becomes 8
+// rows of order + 8 coefficients, one per output of a half-frame: the raw coefficients followed by
+// the response to the earlier outputs of the same half. The rows are kept flat in the layout the
+// reference code reads, and again as matrices for the kernels, which only handle order <= 8.
+class Codebook {
+  public:
+    s32 order = 0, npredictors = 0;
+
+    Codebook() = default;
+
+    // `coefficients` is laid out as in the file: for each predictor, `order` groups of 8
+    Codebook(s32 order, s32 npredictors, const s16 *coefficients)
+        : order(order), npredictors(npredictors), rows(npredictors * 8 * (order + 8)) {
+        assert(order >= 1 && npredictors >= 1);
+        for (s32 k = 0; k < npredictors; k++) {
+            auto at = [this, k](s32 i, s32 c) -> s32 & {
+                return rows[(k * 8 + i) * (this->order + 8) + c];
+            };
+            for (s32 j = 0; j < order; j++) {
+                for (s32 i = 0; i < 8; i++) {
+                    at(i, j) = coefficients[(k * order + j) * 8 + i];
+                }
             }
-        }
 
-        for (s32 k = 1; k < 8; k++) {
-            (*table_entry)[k][*order] = (*table_entry)[k - 1][*order - 1];
-        }
+            for (s32 i = 1; i < 8; i++) {
+                at(i, order) = at(i - 1, order - 1);
+            }
 
-        (*table_entry)[0][*order] = 1 << 11;
+            at(0, order) = 1 << 11;
 
-        for (s32 k = 1; k < 8; k++) {
-            s32 j = 0;
-            for (; j < k; j++) {
-                (*table_entry)[j][k + *order] = 0;
+            for (s32 c = 1; c < 8; c++) {
+                for (s32 i = c; i < 8; i++) {
+                    at(i, c + order) = at(i - c, order);
+                }
             }
+        }
 
-            for (; j < 8; j++) {
-                (*table_entry)[j][k + *order] = (*table_entry)[j - k][*order];
+        if (order <= 8) {
+            matrices.resize(npredictors);
+            for (s32 k = 0; k < npredictors; k++) {
+                for (s32 c = 0; c < order + 8; c++) {
+                    for (s32 i = 0; i < 8; i++) {
+                        matrices[k].cols[c][i] = c < order + i ? row(k, i)[c] : 0;
+                    }
+                }
             }
         }
     }
-    return 0;
-}
 
-vector<ALADPCMLoop> read_loop_points(const vector<byte> &aifcData, size_t *ifile, s16 *nloops) {
-    read_bytes_from_vec(nloops, sizeof(s16), 1, aifcData, ifile);
-    BSWAP16(*nloops);
-    vector<ALADPCMLoop> al(*nloops);
-    for (auto &loop : al) {
-        loop.state.resize(16);
-        read_bytes_from_vec(&loop.start, sizeof(loop.start), 1, aifcData, ifile);
-        read_bytes_from_vec(&loop.end, sizeof(loop.end), 1, aifcData, ifile);
-        read_bytes_from_vec(&loop.count, sizeof(loop.count), 1, aifcData, ifile);
-        read_bytes_from_vec(loop.state.data(), sizeof(*(loop.state.data())), 16, aifcData, ifile);
-        BSWAP32(loop.start);
-        BSWAP32(loop.end);
-        BSWAP32(loop.count);
-        BSWAP16_MANY(loop.state, 16);
+    bool empty(void) const {
+        return npredictors == 0;
+    }
+
+    const s32 *row(s32 k, s32 i) const {
+        return &rows[(k * 8 + i) * (order + 8)];
+    }
+
+    const PredictorMatrix &matrix(s32 k) const {
+        return matrices[k];
     }
-    return al;
+
+  private:
+    vector<s32> rows;
+    vector<PredictorMatrix> matrices;
+};
+
+s32 read_aifc_codebook(span<const byte> aifcData, size_t *fhandle, Codebook &book, s16 *order,
+                       s16 *npredictors) {
+    read_bytes_from_vec(order, sizeof(s16), 1, aifcData, fhandle);
+    BSWAP16(*order);
+    read_bytes_from_vec(npredictors, sizeof(s16), 1, aifcData, fhandle);
+    BSWAP16(*npredictors);
+    if (*order < 1 || *npredictors < 1) {
+        return 1;
+    }
+
+    vector<s16> coefficients(*npredictors * *order * 8);
+    read_bytes_from_vec(coefficients.data(), sizeof(s16), coefficients.size(), aifcData, fhandle);
+    BSWAP16_MANY(coefficients, static_cast<s32>(coefficients.size()));
+    book = Codebook(*order, *npredictors, coefficients.data());
+    return 0;
 }
 
-s32 inner_product(s32 length, const vector<s32> &v1, s32 *v2) {
+s32 inner_product(s32 length, const s32 *v1, s32 *v2) {
     s32 out = 0;
     for (s32 i = 0; i < length; i++) {
         out += v1[i] * v2[i];
     }
 
-    // Compute "out / 2^11", rounded down.
-    s32 dout = out / (1 << 11);
-    s32 fiout = dout * (1 << 11);
-    return dout - (out - fiout < 0);
+    // Compute "out / 2^11", rounded down, which is what an arithmetic shift does.
+    return out >> 11;
 }
 
-void my_decodeframe(u8 *frame, s32 *state, s32 order, const vector<vector<vector<s32>>> &coefTable) {
+void my_decodeframe(u8 *frame, s32 *state, const Codebook &book) {
+    s32 order = book.order;
     s32 ix[16];
 
     u8 header = frame[0];
@@ -652,13 +1286,13 @@ void my_decodeframe(u8 *frame, s32 *state, s32 order, const vector<vector<vector
         for (s32 i = 0; i < 8; i++) {
             s32 ind = j * 8 + i;
             in_vec[order + i] = ix[ind];
-            state[ind] = inner_product(order + i, coefTable[optimalp][i], in_vec) + ix[ind];
+            state[ind] = inner_product(order + i, book.row(optimalp, i), in_vec) + ix[ind];
         }
     }
 }
 
-void my_encodeframe(u8 *out, s16 *inBuffer, s32 *state, const vector<vector<vector<s32>>> &coefTable,
-                    s32 order, s32 npredictors) {
+void my_encodeframe(u8 *out, s16 *inBuffer, s32 *state, const Codebook &book) {
+    s32 order = book.order, npredictors = book.npredictors;
     s16 ix[16];
     s32 prediction[16];
     s32 inVector[16];
@@ -676,7 +1310,7 @@ void my_encodeframe(u8 *out, s16 *inBuffer, s32 *state, const vector<vector<vect
             }
 
             for (s32 i = 0; i < 8; i++) {
-                prediction[j * 8 + i] = inner_product(order + i, coefTable[k][i], inVector);
+                prediction[j * 8 + i] = inner_product(order + i, book.row(k, i), inVector);
                 e[j * 8 + i] = inVector[i + order] = inBuffer[j * 8 + i] - prediction[j * 8 + i];
             }
         }
@@ -698,7 +1332,7 @@ void my_encodeframe(u8 *out, s16 *inBuffer, s32 *state, const vector<vector<vect
         }
 
         for (s32 i = 0; i < 8; i++) {
-            prediction[j * 8 + i] = inner_product(order + i, coefTable[optimalp][i], inVector);
+            prediction[j * 8 + i] = inner_product(order + i, book.row(optimalp, i), inVector);
             e[j * 8 + i] = inVector[i + order] = inBuffer[j * 8 + i] - prediction[j * 8 + i];
         }
     }
@@ -741,7 +1375,7 @@ void my_encodeframe(u8 *out, s16 *inBuffer, s32 *state, const vector<vector<vect
             }
 
             for (s32 i = 0; i < 8; i++) {
-                prediction[base + i] = inner_product(order + i, coefTable[optimalp][i], inVector);
+                prediction[base + i] = inner_product(order + i, book.row(optimalp, i), inVector);
                 s32 se = inBuffer[base + i] - prediction[base + i];
                 ix[base + i] = qsample(se, scale);
                 s32 cV = clamp_to_s16(ix[base + i]) - ix[base + i];
@@ -763,245 +1397,1136 @@ void my_encodeframe(u8 *out, s16 *inBuffer, s32 *state, const vector<vector<vect
     }
 }
 
-void permute(s16 *out, s32 *in, s32 scale) {
+void permute(s16 *out, const s32 *in, s32 scale, u64 *randState) {
     for (s32 i = 0; i < 16; i++) {
-        out[i] = clamp_to_s16(in[i] - scale / 2 + myrand() % (scale + 1));
+        out[i] = clamp_to_s16(in[i] - scale / 2 + myrand(randState) % (scale + 1));
     }
 }
 
-void write_header(vector<byte> &aiffData, size_t *ofile, const char *id, s32 size) {
-    write_bytes_to_vec(id, 4, 1, aiffData, ofile);
-    BSWAP32(size);
-    write_bytes_to_vec(&size, sizeof(s32), 1, aiffData, ofile);
+// Range of residuals x for which qsample(x, scale) == n, i.e. every value the encoder would quantize
+// to the nibble n.
+void qsample_range(s32 n, s32 scale, s32 *lo, s32 *hi) {
+    if (scale == 0) {
+        *lo = *hi = n;
+        return;
+    }
+    s32 step = 1 << scale, half = step / 2;
+    if (n > 0) {
+        *lo = n * step - half + 1;
+        *hi = n * step + half;
+    } else if (n < 0) {
+        *lo = n * step - half;
+        *hi = n * step + half - 1;
+    } else {
+        *lo = -half;
+        *hi = half;
+    }
 }
 
-// Much of the original aifc_decode.c remains unedited, but I have integrated its main
-// routine to take and return the C++ std::vector<std::byte> array datatype I used in the new code.
-// I also vastly improved its memory safety by removing its several unmatched malloc() calls which
-// would have leaked memory when incorporated into a larger C++ program.
-vector<byte> decode_aifc(const vector<byte> &aifcData) {
-    s16 order = -1, nloops = 0, npredictors = -1;
-    vector<ALADPCMLoop> aloops;
-    vector<vector<vector<s32>>> coefTable;
-    s32 state[16], soundPointer = -1, currPos = 0, nSamples = 0;
-    Chunk FormChunk;
-    ChunkHeader Header;
-    CommonChunk CommChunk;
-    InstrumentChunk InstChunk;
-    SoundDataChunk SndDChunk;
-
-    vector<byte> aiffData;
-    size_t inputBufferPosition = 0, outputBufferPosition = 0;
-
-    memset(&InstChunk, 0, sizeof(InstChunk));
-
-    read_bytes_from_vec(&FormChunk, sizeof(FormChunk), 1, aifcData, &inputBufferPosition);
-    BSWAP32(FormChunk.ckID);
-    BSWAP32(FormChunk.formType);
-    if ((FormChunk.ckID != 0x464f524d) || (FormChunk.formType != 0x41494643)) { // FORM, AIFC
-        cerr << "not an AIFF-C file" << endl;
-        return aiffData;
+// Half-frame kernels. Each evaluates the 8 predictions of a half-frame from `order` samples of
+// `history`; all of them round down exactly like inner_product(). The kernels are templates on the
+// order so that common orders get their own copies; an Order of 0 takes it from the argument.
+struct AdpcmKernels {
+    const char *name;
+    // out = M * x, with x the history followed by the 8 scaled residuals (the decoder)
+    void (*predict)(const PredictorMatrix &m, s32 order, const s32 *x, s32 *out);
+    // Residuals of `in` against the open-loop prediction (the encoder's predictor and scale choice)
+    void (*residuals)(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 *e);
+    // Quantized residuals `ix` and reconstructed samples `out` of the closed loop (the encoder's
+    // final pass)
+    void (*quantize)(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 scale,
+                     s32 *ix, s32 *out);
+    // Autocorrelation of `frames` consecutive frames of `frameSize` samples for the order 2 analysis
+    // in tabledesign: out[f][] holds the sum of in[k - a] * in[k - b] over each frame for (a, b) =
+    // (0, 0), (0, 1), (0, 2), (1, 1), (1, 2), (2, 2). Only the order 2 kernels have one.
+    void (*frame_lags)(const s16 *in, size_t frames, size_t frameSize, s64 (*out)[6]);
+    // The same kernels built for order 2, the order of every book in this game, with their loops
+    // unrolled. Other orders, such as extended soundbank content, use the generic ones.
+    const AdpcmKernels *order2;
+
+    const AdpcmKernels &for_order(s32 order) const {
+        return order == 2 && order2 != nullptr ? *order2 : *this;
     }
+};
 
-    for (;;) {
-        s32 num = read_bytes_from_vec(&Header, sizeof(Header), 1, aifcData, &inputBufferPosition);
-        u32 ts;
-        if (num <= 0) {
-            break;
+template <s32 Order>
+void predict_scalar(const PredictorMatrix &m, s32 order, const s32 *x, s32 *out) {
+    order = Order ? Order : order;
+    s32 acc[8] = {};
+    for (s32 c = 0; c < order + 8; c++) {
+        for (s32 i = 0; i < 8; i++) {
+            acc[i] += m.cols[c][i] * x[c];
         }
-        BSWAP32(Header.ckID);
-        BSWAP32(Header.ckSize);
-
-        Header.ckSize++;
-        Header.ckSize &= ~1;
-        s32 cType, offset = inputBufferPosition;
-
-        switch (Header.ckID) {
-            case 0x434f4d4d: // COMM
-                read_bytes_from_vec(&CommChunk, sizeof(CommChunk), 1, aifcData, &inputBufferPosition);
-                BSWAP16(CommChunk.numChannels);
-                BSWAP16(CommChunk.numFramesH);
-                BSWAP16(CommChunk.numFramesL);
-                BSWAP16(CommChunk.sampleSize);
-                BSWAP16(CommChunk.compressionTypeH);
-                BSWAP16(CommChunk.compressionTypeL);
-                cType = (CommChunk.compressionTypeH << 16) + CommChunk.compressionTypeL;
-                if (cType != 0x56415043) { // VAPC
-                    cerr << "file is of the wrong compression type" << endl;
-                    return aiffData;
-                }
-                if (CommChunk.numChannels != 1) {
-                    cerr << "file contains " << CommChunk.numChannels
-                         << " channels, only 1 channel supported" << endl;
-                    return aiffData;
-                }
-                if (CommChunk.sampleSize != 16) {
-                    cerr << "file contains " << CommChunk.sampleSize
-                         << " bit samples, only 16 bit samples supported" << endl;
-                    return aiffData;
+    }
+    for (s32 i = 0; i < 8; i++) {
+        out[i] = acc[i] >> 11;
+    }
+}
+
+// Every residual feeds the predictions after it through its own column, so the accumulators only
+// ever need a rank-1 update per sample.
+template <s32 Order>
+void residuals_scalar(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 *e) {
+    order = Order ? Order : order;
+    s32 acc[8] = {};
+    for (s32 c = 0; c < order; c++) {
+        for (s32 i = 0; i < 8; i++) {
+            acc[i] += m.cols[c][i] * history[c];
+        }
+    }
+    for (s32 i = 0; i < 8; i++) {
+        e[i] = in[i] - (acc[i] >> 11);
+        for (s32 k = 0; k < 8; k++) {
+            acc[k] += m.cols[order + i][k] * e[i];
+        }
+    }
+}
+
+template <s32 Order>
+void quantize_scalar(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 scale,
+                     s32 *ix, s32 *out) {
+    order = Order ? Order : order;
+    s32 acc[8] = {};
+    for (s32 c = 0; c < order; c++) {
+        for (s32 i = 0; i < 8; i++) {
+            acc[i] += m.cols[c][i] * history[c];
+        }
+    }
+    for (s32 i = 0; i < 8; i++) {
+        s32 prediction = acc[i] >> 11;
+        ix[i] = qsample(in[i] - prediction, scale);
+        s32 r = ix[i] * (1 << scale);
+        out[i] = prediction + r;
+        for (s32 k = 0; k < 8; k++) {
+            acc[k] += m.cols[order + i][k] * r;
+        }
+    }
+}
+
+// Every product is exact and so is every sum, so the kernels agree with each other to the bit
+void frame_lags_scalar(const s16 *in, size_t frames, size_t frameSize, s64 (*out)[6]) {
+    for (size_t f = 0; f < frames; f++, in += frameSize) {
+        s64 sums[6] = {};
+        for (size_t k = 0; k < frameSize; k++) {
+            s32 x0 = in[k], x1 = (in - 1)[k], x2 = (in - 2)[k];
+            sums[0] += x0 * x0;
+            sums[1] += x0 * x1;
+            sums[2] += x0 * x2;
+            sums[3] += x1 * x1;
+            sums[4] += x1 * x2;
+            sums[5] += x2 * x2;
+        }
+        memcpy(out[f], sums, sizeof(sums));
+    }
+}
+
+const AdpcmKernels scalar_order2_kernels = { "scalar", predict_scalar<2>, residuals_scalar<2>,
+                                             quantize_scalar<2>, frame_lags_scalar, nullptr };
+const AdpcmKernels scalar_kernels = { "scalar", predict_scalar<0>, residuals_scalar<0>,
+                                      quantize_scalar<0>, nullptr, &scalar_order2_kernels };
+
+#ifdef HAVE_X86_KERNELS
+// SSE4.1 has the 32-bit multiply the kernels need; the 8 rows take two registers.
+template <s32 Order>
+TARGET("sse4.1")
+void predict_sse41(const PredictorMatrix &m, s32 order, const s32 *x, s32 *out) {
+    order = Order ? Order : order;
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    for (s32 c = 0; c < order + 8; c++) {
+        __m128i v = _mm_set1_epi32(x[c]);
+        lo = _mm_add_epi32(lo, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &m.cols[c][0]), v));
+        hi = _mm_add_epi32(hi, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &m.cols[c][4]), v));
+    }
+    _mm_storeu_si128((__m128i *) &out[0], _mm_srai_epi32(lo, 11));
+    _mm_storeu_si128((__m128i *) &out[4], _mm_srai_epi32(hi, 11));
+}
+
+template <s32 Order>
+TARGET("sse4.1")
+void residuals_sse41(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 *e) {
+    order = Order ? Order : order;
+    alignas(16) s32 acc[8];
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    for (s32 c = 0; c < order; c++) {
+        __m128i v = _mm_set1_epi32(history[c]);
+        lo = _mm_add_epi32(lo, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &m.cols[c][0]), v));
+        hi = _mm_add_epi32(hi, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &m.cols[c][4]), v));
+    }
+    for (s32 i = 0; i < 8; i++) {
+        _mm_store_si128((__m128i *) &acc[0], lo);
+        _mm_store_si128((__m128i *) &acc[4], hi);
+        e[i] = in[i] - (acc[i] >> 11);
+        __m128i v = _mm_set1_epi32(e[i]);
+        const s32 *col = m.cols[order + i];
+        lo = _mm_add_epi32(lo, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &col[0]), v));
+        hi = _mm_add_epi32(hi, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &col[4]), v));
+    }
+}
+
+template <s32 Order>
+TARGET("sse4.1")
+void quantize_sse41(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 scale,
+                    s32 *ix, s32 *out) {
+    order = Order ? Order : order;
+    alignas(16) s32 acc[8];
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    for (s32 c = 0; c < order; c++) {
+        __m128i v = _mm_set1_epi32(history[c]);
+        lo = _mm_add_epi32(lo, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &m.cols[c][0]), v));
+        hi = _mm_add_epi32(hi, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &m.cols[c][4]), v));
+    }
+    for (s32 i = 0; i < 8; i++) {
+        _mm_store_si128((__m128i *) &acc[0], lo);
+        _mm_store_si128((__m128i *) &acc[4], hi);
+        s32 prediction = acc[i] >> 11;
+        ix[i] = qsample(in[i] - prediction, scale);
+        s32 r = ix[i] * (1 << scale);
+        out[i] = prediction + r;
+        __m128i v = _mm_set1_epi32(r);
+        const s32 *col = m.cols[order + i];
+        lo = _mm_add_epi32(lo, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &col[0]), v));
+        hi = _mm_add_epi32(hi, _mm_mullo_epi32(_mm_load_si128((const __m128i *) &col[4]), v));
+    }
+}
+
+// Each lane of _mm_madd_epi16() is the sum of two products, somewhere in [-(2^31 - 2^16), 2^31].
+// Offset by LAG_BIAS that fits an unsigned lane exactly, even the one sum (both products -32768
+// squared) that overflows a signed one, so the lanes can be widened to 64 bits without losing it.
+const s32 LAG_BIAS = 0x7fff0000;
+
+TARGET("sse4.1")
+__m128i widen_lags_sse41(__m128i pairs) {
+    __m128i biased = _mm_add_epi32(pairs, _mm_set1_epi32(LAG_BIAS));
+    return _mm_add_epi64(_mm_srli_epi64(biased, 32),
+                         _mm_and_si128(biased, _mm_set1_epi64x(UINT32_MAX)));
+}
+
+// Two sums at a time: [a0 + a1, b0 + b1], less the bias
+TARGET("sse4.1")
+void store_lags_sse41(__m128i a, __m128i b, __m128i bias, s64 *out) {
+    __m128i sums = _mm_add_epi64(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+    _mm_storeu_si128((__m128i *) out, _mm_sub_epi64(sums, bias));
+}
+
+TARGET("sse4.1")
+void frame_lags_sse41(const s16 *in, size_t frames, size_t frameSize, s64 (*out)[6]) {
+    if (frameSize % 8 != 0) {
+        frame_lags_scalar(in, frames, frameSize, out);
+        return;
+    }
+    __m128i bias = _mm_set1_epi64x(4 * static_cast<s64>(LAG_BIAS) * (frameSize / 8));
+    for (size_t f = 0; f < frames; f++, in += frameSize) {
+        __m128i s00 = _mm_setzero_si128(), s01 = s00, s02 = s00, s11 = s00, s12 = s00, s22 = s00;
+        for (size_t k = 0; k < frameSize; k += 8) {
+            __m128i x0 = _mm_loadu_si128((const __m128i *) (in + k));
+            __m128i x1 = _mm_loadu_si128((const __m128i *) (in + k - 1));
+            __m128i x2 = _mm_loadu_si128((const __m128i *) (in + k - 2));
+            s00 = _mm_add_epi64(s00, widen_lags_sse41(_mm_madd_epi16(x0, x0)));
+            s01 = _mm_add_epi64(s01, widen_lags_sse41(_mm_madd_epi16(x0, x1)));
+            s02 = _mm_add_epi64(s02, widen_lags_sse41(_mm_madd_epi16(x0, x2)));
+            s11 = _mm_add_epi64(s11, widen_lags_sse41(_mm_madd_epi16(x1, x1)));
+            s12 = _mm_add_epi64(s12, widen_lags_sse41(_mm_madd_epi16(x1, x2)));
+            s22 = _mm_add_epi64(s22, widen_lags_sse41(_mm_madd_epi16(x2, x2)));
+        }
+        store_lags_sse41(s00, s01, bias, &out[f][0]);
+        store_lags_sse41(s02, s11, bias, &out[f][2]);
+        store_lags_sse41(s12, s22, bias, &out[f][4]);
+    }
+}
+
+const AdpcmKernels sse41_order2_kernels = { "sse4.1", predict_sse41<2>, residuals_sse41<2>,
+                                            quantize_sse41<2>, frame_lags_sse41, nullptr };
+const AdpcmKernels sse41_kernels = { "sse4.1", predict_sse41<0>, residuals_sse41<0>,
+                                     quantize_sse41<0>, nullptr, &sse41_order2_kernels };
+
+// AVX2 fits all 8 rows of a half-frame in one register.
+template <s32 Order>
+TARGET("avx2")
+void predict_avx2(const PredictorMatrix &m, s32 order, const s32 *x, s32 *out) {
+    order = Order ? Order : order;
+    __m256i acc = _mm256_setzero_si256();
+    for (s32 c = 0; c < order + 8; c++) {
+        __m256i col = _mm256_load_si256((const __m256i *) m.cols[c]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(col, _mm256_set1_epi32(x[c])));
+    }
+    _mm256_storeu_si256((__m256i *) out, _mm256_srai_epi32(acc, 11));
+}
+
+template <s32 Order>
+TARGET("avx2")
+void residuals_avx2(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 *e) {
+    order = Order ? Order : order;
+    alignas(32) s32 lanes[8];
+    __m256i acc = _mm256_setzero_si256();
+    for (s32 c = 0; c < order; c++) {
+        __m256i col = _mm256_load_si256((const __m256i *) m.cols[c]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(col, _mm256_set1_epi32(history[c])));
+    }
+    for (s32 i = 0; i < 8; i++) {
+        _mm256_store_si256((__m256i *) lanes, acc);
+        e[i] = in[i] - (lanes[i] >> 11);
+        __m256i col = _mm256_load_si256((const __m256i *) m.cols[order + i]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(col, _mm256_set1_epi32(e[i])));
+    }
+}
+
+template <s32 Order>
+TARGET("avx2")
+void quantize_avx2(const PredictorMatrix &m, s32 order, const s32 *history, const s32 *in, s32 scale,
+                   s32 *ix, s32 *out) {
+    order = Order ? Order : order;
+    alignas(32) s32 lanes[8];
+    __m256i acc = _mm256_setzero_si256();
+    for (s32 c = 0; c < order; c++) {
+        __m256i col = _mm256_load_si256((const __m256i *) m.cols[c]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(col, _mm256_set1_epi32(history[c])));
+    }
+    for (s32 i = 0; i < 8; i++) {
+        _mm256_store_si256((__m256i *) lanes, acc);
+        s32 prediction = lanes[i] >> 11;
+        ix[i] = qsample(in[i] - prediction, scale);
+        s32 r = ix[i] * (1 << scale);
+        out[i] = prediction + r;
+        __m256i col = _mm256_load_si256((const __m256i *) m.cols[order + i]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(col, _mm256_set1_epi32(r)));
+    }
+}
+
+TARGET("avx2")
+__m256i widen_lags_avx2(__m256i pairs) {
+    __m256i biased = _mm256_add_epi32(pairs, _mm256_set1_epi32(LAG_BIAS));
+    return _mm256_add_epi64(_mm256_srli_epi64(biased, 32),
+                            _mm256_and_si256(biased, _mm256_set1_epi64x(UINT32_MAX)));
+}
+
+// [a0 + a1, b0 + b1, a2 + a3, b2 + b3], then the two halves added together
+TARGET("avx2")
+void store_lags_avx2(__m256i a, __m256i b, __m128i bias, s64 *out) {
+    __m256i sums = _mm256_add_epi64(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+    __m128i total = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    _mm_storeu_si128((__m128i *) out, _mm_sub_epi64(total, bias));
+}
+
+// A 16-sample frame is a single register per lag
+TARGET("avx2")
+void frame_lags_avx2(const s16 *in, size_t frames, size_t frameSize, s64 (*out)[6]) {
+    if (frameSize % 16 != 0) {
+        frame_lags_sse41(in, frames, frameSize, out);
+        return;
+    }
+    __m128i bias = _mm_set1_epi64x(8 * static_cast<s64>(LAG_BIAS) * (frameSize / 16));
+    for (size_t f = 0; f < frames; f++, in += frameSize) {
+        __m256i s00 = _mm256_setzero_si256(), s01 = s00, s02 = s00, s11 = s00, s12 = s00, s22 = s00;
+        for (size_t k = 0; k < frameSize; k += 16) {
+            __m256i x0 = _mm256_loadu_si256((const __m256i *) (in + k));
+            __m256i x1 = _mm256_loadu_si256((const __m256i *) (in + k - 1));
+            __m256i x2 = _mm256_loadu_si256((const __m256i *) (in + k - 2));
+            s00 = _mm256_add_epi64(s00, widen_lags_avx2(_mm256_madd_epi16(x0, x0)));
+            s01 = _mm256_add_epi64(s01, widen_lags_avx2(_mm256_madd_epi16(x0, x1)));
+            s02 = _mm256_add_epi64(s02, widen_lags_avx2(_mm256_madd_epi16(x0, x2)));
+            s11 = _mm256_add_epi64(s11, widen_lags_avx2(_mm256_madd_epi16(x1, x1)));
+            s12 = _mm256_add_epi64(s12, widen_lags_avx2(_mm256_madd_epi16(x1, x2)));
+            s22 = _mm256_add_epi64(s22, widen_lags_avx2(_mm256_madd_epi16(x2, x2)));
+        }
+        store_lags_avx2(s00, s01, bias, &out[f][0]);
+        store_lags_avx2(s02, s11, bias, &out[f][2]);
+        store_lags_avx2(s12, s22, bias, &out[f][4]);
+    }
+}
+
+const AdpcmKernels avx2_order2_kernels = { "avx2", predict_avx2<2>, residuals_avx2<2>,
+                                           quantize_avx2<2>, frame_lags_avx2, nullptr };
+const AdpcmKernels avx2_kernels = { "avx2", predict_avx2<0>, residuals_avx2<0>,
+                                    quantize_avx2<0>, nullptr, &avx2_order2_kernels };
+#endif
+
+// Picks the kernels by name, or the best ones this CPU supports when `name` is null. Returns null
+// for a name that is unknown or not supported here.
+const AdpcmKernels *select_kernels(const char *name) {
+    vector<const AdpcmKernels *> supported;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        supported.push_back(&avx2_kernels);
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        supported.push_back(&sse41_kernels);
+    }
+#endif
+    supported.push_back(&scalar_kernels);
+
+    for (const auto *kernels : supported) {
+        if (name == nullptr || strcmp(name, kernels->name) == 0) {
+            return kernels;
+        }
+    }
+    return nullptr;
+}
+
+// Chosen once at startup; main() may swap in another set before any work starts
+const AdpcmKernels *adpcm_kernels = select_kernels(nullptr);
+
+// my_decodeframe() on the kernels
+void decode_frame(const u8 *frame, s32 *state, const Codebook &book) {
+    const AdpcmKernels &kernels = adpcm_kernels->for_order(book.order);
+    s32 scale = 1 << (frame[0] >> 4), optimalp = frame[0] & 0xf;
+    s32 x[16], prediction[8];
+
+    for (s32 j = 0; j < 2; j++) {
+        memcpy(x, &state[j == 0 ? 16 - book.order : 8 - book.order], book.order * sizeof(s32));
+        for (s32 i = 0; i < 8; i++) {
+            u8 c = frame[1 + (j * 8 + i) / 2];
+            x[book.order + i] = toi4(i % 2 ? c & 0xf : c >> 4) * scale;
+        }
+        kernels.predict(book.matrix(optimalp), book.order, x, prediction);
+        for (s32 i = 0; i < 8; i++) {
+            state[j * 8 + i] = prediction[i] + x[book.order + i];
+        }
+    }
+}
+
+// Open-loop residuals of `guess` under predictor `k`, as my_encodeframe() computes them, and the sum
+// of their squares in the same order. Gives up after a half-frame once the sum exceeds `stop`: the
+// terms are never negative, so the sum can't come back down.
+f32 open_loop_error(const s32 *guess, const s32 *lastState, const Codebook &book, s32 k, f32 stop,
+                    s32 *e) {
+    const AdpcmKernels &kernels = adpcm_kernels->for_order(book.order);
+    f32 se = 0.0f;
+
+    for (s32 j = 0; j < 2; j++) {
+        const s32 *history = j == 0 ? &lastState[16 - book.order] : &guess[8 - book.order];
+        kernels.residuals(book.matrix(k), book.order, history, &guess[j * 8], &e[j * 8]);
+        for (s32 i = 0; i < 8; i++) {
+            se += (f32) e[j * 8 + i] * (f32) e[j * 8 + i];
+        }
+        if (se > stop) {
+            break;
+        }
+    }
+    return se;
+}
+
+// Whether my_encodeframe() turns `guess` into exactly `input`. Rather than encoding the whole frame
+// and comparing, this stops as soon as the answer is no: when the encoder would pick a different
+// scale, when another predictor beats the frame's one, or at the first wrong nibble.
+bool encodes_to(const u8 *input, const s16 *guess, const s32 *lastState, const Codebook &book) {
+    const AdpcmKernels &kernels = adpcm_kernels->for_order(book.order);
+    s32 scale = input[0] >> 4, optimalp = input[0] & 0xf;
+    s32 in[16], e[16], other[16];
+
+    if (optimalp >= book.npredictors) {
+        return false;
+    }
+    copy(guess, guess + 16, in);
+
+    f32 min = open_loop_error(in, lastState, book, optimalp, INFINITY, e);
+
+    s32 max = 0;
+    for (s32 i = 0; i < 16; i++) {
+        s32 ie = clamp_to_s16(e[i]);
+        if (abs(ie) > abs(max)) {
+            max = ie;
+        }
+    }
+    s32 encoderScale = 0;
+    for (; encoderScale <= 12 && (max > 7 || max < -8); encoderScale++) {
+        max /= 2;
+    }
+    if (std::min(encoderScale, 12) != scale) {
+        return false;
+    }
+
+    // The encoder keeps the first predictor with the smallest error, so earlier ones must do
+    // strictly worse and later ones no better
+    for (s32 k = 0; k < book.npredictors; k++) {
+        if (k == optimalp) {
+            continue;
+        }
+        f32 stop = k < optimalp ? min : nextafter(min, -1.0f);
+        if (open_loop_error(in, lastState, book, k, stop, other) <= stop) {
+            return false;
+        }
+    }
+
+    s32 ix[8], state[16];
+    for (s32 j = 0; j < 2; j++) {
+        const s32 *history = j == 0 ? &lastState[16 - book.order] : &state[8 - book.order];
+        kernels.quantize(book.matrix(optimalp), book.order, history, &in[j * 8], scale, ix,
+                                &state[j * 8]);
+        for (s32 i = 0; i < 8; i++) {
+            u8 c = input[1 + (j * 8 + i) / 2];
+            if ((ix[i] & 0xf) != (i % 2 ? c & 0xf : c >> 4)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Most candidate frames encode_matches() takes per call. Every step of the encoder runs as a loop
+// over the lanes, which the compiler turns into vector code.
+const s32 ENCODE_LANES = 16;
+
+// Residuals of the open-loop prediction with predictor `k`, as in the first half of my_encodeframe(),
+// for every lane of `in` at once.
+template <s32 Lanes>
+void encode_lanes_residuals(const s32 (*in)[Lanes], const s32 *lastState, const Codebook &book, s32 k,
+                            s32 (*e)[Lanes]) {
+    s32 order = book.order;
+    s32 inVector[16][Lanes];
+
+    for (s32 j = 0; j < 2; j++) {
+        for (s32 i = 0; i < order; i++) {
+            for (s32 l = 0; l < Lanes; l++) {
+                inVector[i][l] = (j == 0 ? lastState[16 - order + i] : in[8 - order + i][l]);
+            }
+        }
+
+        for (s32 i = 0; i < 8; i++) {
+            const s32 *row = book.row(k, i);
+            s32 acc[Lanes] = {};
+            for (s32 m = 0; m < order + i; m++) {
+                for (s32 l = 0; l < Lanes; l++) {
+                    acc[l] += row[m] * inVector[m][l];
                 }
+            }
+            // inner_product() rounds down, which is exactly an arithmetic shift
+            for (s32 l = 0; l < Lanes; l++) {
+                e[j * 8 + i][l] = inVector[i + order][l] = in[j * 8 + i][l] - (acc[l] >> 11);
+            }
+        }
+    }
+}
+
+template <s32 Lanes>
+u32 encode_lanes_matches(const u8 *input, const s16 (*guesses)[16], s32 count, const s32 *lastState,
+                         const Codebook &book) {
+    s32 in[16][Lanes], e[16][Lanes];
+    s32 scale = input[0] >> 4, optimalp = input[0] & 0xf;
+    u32 mask = (1u << count) - 1;
+
+    if (optimalp >= book.npredictors) {
+        return 0;
+    }
+
+    for (s32 i = 0; i < 16; i++) {
+        for (s32 l = 0; l < Lanes; l++) {
+            in[i][l] = l < count ? guesses[l][i] : 0;
+        }
+    }
+
+    // Predictor choice, on the squared open-loop residuals summed in the same order as the encoder
+    f32 min[Lanes];
+    s32 predictor[Lanes] = {};
+    fill(min, min + Lanes, 1e30f);
+    for (s32 k = 0; k < book.npredictors; k++) {
+        encode_lanes_residuals<Lanes>(in, lastState, book, k, e);
+        f32 se[Lanes] = {};
+        for (s32 j = 0; j < 16; j++) {
+            for (s32 l = 0; l < Lanes; l++) {
+                se[l] += (f32) e[j][l] * (f32) e[j][l];
+            }
+        }
+        for (s32 l = 0; l < Lanes; l++) {
+            if (se[l] < min[l]) {
+                min[l] = se[l];
+                predictor[l] = k;
+            }
+        }
+    }
+    for (s32 l = 0; l < count; l++) {
+        if (predictor[l] != optimalp) {
+            mask &= ~(1u << l);
+        }
+    }
+    if (mask == 0) {
+        return 0;
+    }
+
+    // Scale choice, from the first largest clamped residual
+    encode_lanes_residuals<Lanes>(in, lastState, book, optimalp, e);
+    for (s32 l = 0; l < count; l++) {
+        s32 max = 0;
+        for (s32 i = 0; i < 16; i++) {
+            s32 ie = clamp_to_s16(e[i][l]);
+            if (abs(ie) > abs(max)) {
+                max = ie;
+            }
+        }
+        s32 laneScale = 0;
+        for (; laneScale <= 12 && (max > 7 || max < -8); laneScale++) {
+            max /= 2;
+        }
+        if (std::min(laneScale, 12) != scale) {
+            mask &= ~(1u << l);
+        }
+    }
+    if (mask == 0) {
+        return 0;
+    }
 
-                nSamples = (CommChunk.numFramesH << 16) + CommChunk.numFramesL;
+    // Quantize against the reconstructed state and compare the nibbles
+    s32 inVector[16][Lanes], state[16][Lanes];
+    for (s32 j = 0; j < 2; j++) {
+        s32 base = j * 8;
+        for (s32 i = 0; i < book.order; i++) {
+            for (s32 l = 0; l < Lanes; l++) {
+                inVector[i][l] =
+                    (j == 0 ? lastState[16 - book.order + i] : state[8 - book.order + i][l]);
+            }
+        }
 
-                // Allow broken input lengths
-                if (nSamples % 16) {
-                    nSamples--;
+        for (s32 i = 0; i < 8; i++) {
+            const s32 *row = book.row(optimalp, i);
+            s32 acc[Lanes] = {};
+            for (s32 m = 0; m < book.order + i; m++) {
+                for (s32 l = 0; l < Lanes; l++) {
+                    acc[l] += row[m] * inVector[m][l];
                 }
+            }
+            u8 c = input[1 + (base + i) / 2];
+            s32 nibble = (base + i) % 2 ? c & 0xf : c >> 4;
+            for (s32 l = 0; l < Lanes; l++) {
+                s32 prediction = acc[l] >> 11;
+                s16 ix = qsample(in[base + i][l] - prediction, scale);
+                if ((ix & 0xf) != nibble) {
+                    mask &= ~(1u << l);
+                }
+                inVector[i + book.order][l] = ix * (1 << scale);
+                state[base + i][l] = prediction + inVector[i + book.order][l];
+            }
+        }
+    }
+
+    return mask & ((1u << count) - 1);
+}
+
+// Batched encodes_to(): checks up to Lanes candidate frames that all start from `lastState`
+// and returns a mask with bit l set if `guesses[l]` encodes to exactly `input`. Candidates drop out
+// as soon as the encoder would pick another predictor or scale, and the quantization pass only runs
+// on whatever is left. Small batches run on narrower lanes, and a single candidate on the scalar
+// encoder, so they don't pay for the full width.
+u32 encode_matches(const u8 *input, const s16 (*guesses)[16], s32 count, const s32 *lastState,
+                   const Codebook &book) {
+    assert(count > 0 && count <= ENCODE_LANES);
+    if (count == 1) {
+        return encodes_to(input, guesses[0], lastState, book);
+    }
+    if (count <= 4) {
+        return encode_lanes_matches<4>(input, guesses, count, lastState, book);
+    }
+    if (count <= 8) {
+        return encode_lanes_matches<8>(input, guesses, count, lastState, book);
+    }
+    return encode_lanes_matches<ENCODE_LANES>(input, guesses, count, lastState, book);
+}
 
-                if (nSamples % 16 != 0) {
-                    cerr << "number of chunks must be a multiple of 16, found " << nSamples << endl;
-                    return aiffData;
+// How far `guess` is from making my_encodeframe() choose the predictor `optimalp` and the scale
+// `scale`. Both choices are made on the unquantized residuals, which depend on the guess itself.
+// Zero means both choices match; the nibbles then match as well as long as every sample stays
+// inside its quantization interval.
+double roundtrip_violation(const s16 *guess, const s32 *lastState, s32 optimalp, s32 scale,
+                           const Codebook &book) {
+    s32 in[16], e[16], target_e[16];
+    f32 se[16];
+
+    copy(guess, guess + 16, in);
+    for (s32 k = 0; k < book.npredictors; k++) {
+        se[k] = open_loop_error(in, lastState, book, k, INFINITY, e);
+        if (k == optimalp) {
+            memcpy(target_e, e, sizeof(e));
+        }
+    }
+
+    // The encoder keeps the first predictor with the strictly smallest error
+    double predictor_miss = 0.0;
+    for (s32 k = 0; k < book.npredictors; k++) {
+        if (k < optimalp) {
+            predictor_miss += max(0.0, (double) se[optimalp] - se[k] + 1.0);
+        } else if (k > optimalp) {
+            predictor_miss += max(0.0, (double) se[optimalp] - se[k]);
+        }
+    }
+
+    s32 max = 0, encoderScale;
+    for (s32 i = 0; i < 16; i++) {
+        if (abs(clamp_to_s16(target_e[i])) > abs(max)) {
+            max = clamp_to_s16(target_e[i]);
+        }
+    }
+    for (encoderScale = 0; encoderScale < 12; encoderScale++) {
+        if (max >= -9 * (1 << encoderScale) + 1 && max <= 8 * (1 << encoderScale) - 1) {
+            break;
+        }
+    }
+
+    // A residual r gives a scale of at most s when -9 * 2^s < r < 8 * 2^s.
+    double scale_miss = 0.0;
+    if (encoderScale > scale) {
+        s32 lo = -9 * (1 << scale) + 1, hi = 8 * (1 << scale) - 1;
+        for (s32 i = 0; i < 16; i++) {
+            s32 ie = clamp_to_s16(target_e[i]);
+            scale_miss += ie < lo ? lo - ie : (ie > hi ? ie - hi : 0);
+        }
+    } else if (encoderScale < scale) {
+        // Some residual has to leave that range and also be the one picked as the maximum, which
+        // is the first residual of largest magnitude.
+        s32 lo = -9 * (1 << (scale - 1)), hi = 8 * (1 << (scale - 1));
+        scale_miss = 1 << 17;
+        for (s32 i = 0; i < 16; i++) {
+            s32 ie = clamp_to_s16(target_e[i]), before = 0, after = 0;
+            for (s32 j = 0; j < 16; j++) {
+                s32 magnitude = abs(clamp_to_s16(target_e[j]));
+                if (j < i) {
+                    before = std::max(before, magnitude + 1);
+                } else if (j > i) {
+                    after = std::max(after, magnitude);
                 }
-                break;
+            }
+            s32 need = ie >= 0 ? std::max({ hi - ie, before - ie, after - ie })
+                              : std::max({ ie - lo, before + ie, after + ie });
+            scale_miss = min(scale_miss, (double) std::max(need, 1));
+        }
+    }
 
-            case 0x53534e44: // SSND
-                read_bytes_from_vec(&SndDChunk, sizeof(SndDChunk), 1, aifcData, &inputBufferPosition);
-                BSWAP32(SndDChunk.offset);
-                BSWAP32(SndDChunk.blockSize);
-                assert(SndDChunk.offset == 0);
-                assert(SndDChunk.blockSize == 0);
-                soundPointer = inputBufferPosition;
-                break;
+    return scale_miss + sqrt(predictor_miss);
+}
 
-            case 0x4150504c: // APPL
-                read_bytes_from_vec(&ts, sizeof(u32), 1, aifcData, &inputBufferPosition);
-                BSWAP32(ts);
-                if (ts == 0x73746f63) { // stoc
-                    u8 len;
-                    read_bytes_from_vec(&len, 1, 1, aifcData, &inputBufferPosition);
-                    if (len == 11) {
-                        char ChunkName[12];
-                        s16 version;
-                        read_bytes_from_vec(ChunkName, 11, 1, aifcData, &inputBufferPosition);
-                        ChunkName[11] = '\0';
-                        if (strcmp("VADPCMCODES", ChunkName) == 0) {
-                            read_bytes_from_vec(&version, sizeof(s16), 1, aifcData,
-                                                &inputBufferPosition);
-                            BSWAP16(version);
-                            if (version != 1) {
-                                cerr << "Unknown codebook chunk version" << endl;
-                                return aiffData;
-                            }
-                            read_aifc_codebook(aifcData, &inputBufferPosition, coefTable, &order,
-                                               &npredictors);
-                        } else if (strcmp("VADPCMLOOPS", ChunkName) == 0) {
-                            read_bytes_from_vec(&version, sizeof(s16), 1, aifcData,
-                                                &inputBufferPosition);
-                            BSWAP16(version);
-                            if (version != 1) {
-                                cerr << "Unknown loop chunk version" << endl;
-                                return aiffData;
-                            }
-                            aloops = read_loop_points(aifcData, &inputBufferPosition, &nloops);
-                            if (nloops != 1) {
-                                cerr << "Only a single loop supported" << endl;
-                                return aiffData;
-                            }
-                        }
+// Narrows `lo`/`hi` to the 16-bit PCM values each sample of the frame could have been encoded from,
+// given the decoded output. Returns false if some sample has no such value at all.
+bool frame_intervals(const u8 *input, const s32 *decoded, s32 *lo, s32 *hi) {
+    s32 scale = input[0] >> 4;
+    for (s32 i = 0; i < 16; i++) {
+        s32 n = toi4(i % 2 ? input[1 + i / 2] & 0xf : input[1 + i / 2] >> 4);
+        s32 prediction = decoded[i] - n * (1 << scale);
+        qsample_range(n, scale, &lo[i], &hi[i]);
+        lo[i] = max(prediction + lo[i], -0x8000);
+        hi[i] = min(prediction + hi[i], 0x7fff);
+        if (lo[i] > hi[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Deterministic replacement for the random search. Given the frame's scale and predictor, the
+// prediction for every sample follows from the real decode, so each sample has an exact interval
+// of PCM values that quantizes back to its nibble. Starting from the original decode clamped into
+// those intervals, a coordinate descent fixes up the encoder's predictor and scale choices, then
+// every sample is pulled back as close to the original decode as the roundtrip allows.
+bool solve_frame(const u8 *input, const s32 *lastState, const s32 *decoded, const s16 *origGuess,
+                 s16 *guess, const Codebook &book, u64 randState) {
+    s32 scale = input[0] >> 4, optimalp = input[0] & 0xf;
+    s32 lo[16], hi[16];
+
+    if (scale > 12 || optimalp >= book.npredictors || book.npredictors > 16) {
+        return false;
+    }
+
+    if (!frame_intervals(input, decoded, lo, hi)) {
+        return false;
+    }
+    for (s32 i = 0; i < 16; i++) {
+        guess[i] = clamp(static_cast<s32>(origGuess[i]), lo[i], hi[i]);
+    }
+
+    // The descent can stall in a local minimum; restart it from a few points drawn from the
+    // intervals, seeded per frame so the result does not depend on scheduling.
+    double violation = 1.0;
+    for (s32 restart = 0; violation > 0.0 && restart < 16; restart++) {
+        if (restart > 0) {
+            for (s32 i = 0; i < 16; i++) {
+                guess[i] = lo[i] + static_cast<s32>(myrand(&randState) % (hi[i] - lo[i] + 1));
+            }
+        }
+        violation = roundtrip_violation(guess, lastState, optimalp, scale, book);
+        for (s32 round = 0; violation > 0.0 && round < 8; round++) {
+            bool improved = false;
+            for (s32 i = 0; i < 16 && violation > 0.0; i++) {
+                s32 width = hi[i] - lo[i];
+                s32 candidates[7] = { lo[i],           lo[i] + width / 4, lo[i] + width / 2,
+                                      hi[i] - width / 4, hi[i],           guess[i] - 1,
+                                      guess[i] + 1 };
+                s16 current = guess[i], best = guess[i];
+                double best_violation = violation;
+                for (s32 candidate : candidates) {
+                    if (candidate < lo[i] || candidate > hi[i] || candidate == current) {
+                        continue;
                     }
+                    guess[i] = candidate;
+                    double v = roundtrip_violation(guess, lastState, optimalp, scale, book);
+                    if (v < best_violation
+                        || (v == best_violation
+                            && abs(candidate - origGuess[i]) < abs(best - origGuess[i]))) {
+                        best_violation = v;
+                        best = candidate;
+                    }
+                }
+                guess[i] = best;
+                if (best_violation < violation) {
+                    violation = best_violation;
+                    improved = true;
                 }
+            }
+            if (!improved) {
                 break;
+            }
         }
+    }
+
+    if (violation > 0.0 || !encodes_to(input, guess, lastState, book)) {
+        return false;
+    }
 
-        inputBufferPosition = offset + Header.ckSize;
+    // Pull each sample back towards the original decode, bisecting between the last value that
+    // still roundtrips and the closest one allowed by its interval.
+    for (s32 i = 0; i < 16; i++) {
+        s32 good = guess[i], target = clamp(static_cast<s32>(origGuess[i]), lo[i], hi[i]);
+        s32 probe = target;
+        while (probe != good) {
+            guess[i] = probe;
+            if (encodes_to(input, guess, lastState, book)) {
+                good = probe;
+                probe = target;
+            } else {
+                probe = good + (probe - good) / 2;
+            }
+        }
+        guess[i] = good;
     }
 
-    if (!coefTable.size()) {
-        cerr << "Codebook missing from bitstream" << endl;
-        return aiffData;
+    return true;
+}
+
+// Per-frame limits on the searches that back up solve_frame. Each of the random search and the
+// enumeration gets `tries` encodes. A zero `time` means no time limit, which keeps the output
+// independent of how fast the machine is.
+struct RoundtripBudget {
+    u64 tries = 1 << 20;
+    chrono::milliseconds time{ 0 };
+};
+
+// How a frame was matched. Anything past ROUNDTRIP_SOLVED is reported per sample.
+enum RoundtripResult : u8 {
+    ROUNDTRIP_EXACT,
+    ROUNDTRIP_SOLVED,
+    ROUNDTRIP_RANDOM,
+    ROUNDTRIP_ENUMERATED,
+    ROUNDTRIP_FAILED
+};
+
+const char *roundtrip_result_name(RoundtripResult result) {
+    switch (result) {
+        case ROUNDTRIP_EXACT:
+            return "exact";
+        case ROUNDTRIP_SOLVED:
+            return "solved";
+        case ROUNDTRIP_RANDOM:
+            return "random";
+        case ROUNDTRIP_ENUMERATED:
+            return "enumerated";
+        default:
+            return "unmatched";
     }
+}
 
-    for (s32 i = 0; i < order; i++) {
-        state[15 - i] = 0;
+// Tracks the try count and deadline for one search. The clock is only read every 1024 tries.
+class SearchBudget {
+  public:
+    SearchBudget(const RoundtripBudget &budget)
+        : tries(budget.tries), timed(budget.time.count() > 0),
+          deadline(chrono::steady_clock::now() + budget.time) {
     }
 
-    u32 outputBytes = nSamples * sizeof(s16);
-    vector<u8> outputBuf(outputBytes);
+    bool take(void) {
+        if (tries == 0) {
+            return false;
+        }
+        tries--;
+        if (timed && tries % 1024 == 0 && chrono::steady_clock::now() >= deadline) {
+            tries = 0;
+        }
+        return true;
+    }
 
-    inputBufferPosition = soundPointer;
-    while (currPos < nSamples) {
-        u8 input[9];
-        u8 encoded[9];
-        s32 lastState[16];
-        s32 decoded[16];
-        s16 guess[16];
-        s16 origGuess[16];
+    bool exhausted(void) const {
+        return tries == 0;
+    }
 
-        memcpy(lastState, state, sizeof(lastState));
-        read_bytes_from_vec(input, 9, 1, aifcData, &inputBufferPosition);
+    u64 remaining(void) const {
+        return tries;
+    }
 
-        // Decode for real
-        my_decodeframe(input, state, order, coefTable);
-        memcpy(decoded, state, sizeof(lastState));
+  private:
+    u64 tries;
+    bool timed;
+    chrono::steady_clock::time_point deadline;
+};
 
-        // Create a guess from that, by clamping to 16 bits
-        for (s32 i = 0; i < 16; i++) {
-            origGuess[i] = clamp_to_s16(state[i]);
-        }
-
-        // Encode the guess
-        memcpy(state, lastState, sizeof(lastState));
-        memcpy(guess, origGuess, sizeof(guess));
-        my_encodeframe(encoded, guess, state, coefTable, order, npredictors);
-
-        // If it doesn't match, randomly round numbers until it does.
-        if (memcmp(input, encoded, 9) != 0) {
-            s32 scale = 1 << (input[0] >> 4);
-            do {
-                permute(guess, decoded, scale);
-                memcpy(state, lastState, sizeof(lastState));
-                my_encodeframe(encoded, guess, state, coefTable, order, npredictors);
-            } while (memcmp(input, encoded, 9) != 0);
-
-            // Bring the matching closer to the original decode (not strictly
-            // necessary, but it will move us closer to the target on average).
-            for (s32 failures = 0; failures < 50; failures++) {
-                s32 ind = myrand() % 16;
-                s32 old = guess[ind];
-                if (old == origGuess[ind]) {
-                    continue;
-                }
-                guess[ind] = origGuess[ind];
-                if (myrand() % 2) {
-                    guess[ind] += (old - origGuess[ind]) / 2;
-                }
-                memcpy(state, lastState, sizeof(lastState));
-                my_encodeframe(encoded, guess, state, coefTable, order, npredictors);
-                if (memcmp(input, encoded, 9) == 0) {
-                    failures = -1;
-                } else {
-                    guess[ind] = old;
-                }
+// Systematic search outwards from the original decode. Every sample gets a short ladder of values
+// from its nibble interval, sorted by distance from the clamped decode: the value itself, its
+// neighbours, then points spread over the whole interval, since a match often needs one sample
+// moved far enough to change the encoder's scale. Frames are visited in order of the total rung
+// over all samples. `capacity[pos]` is the highest total samples pos..15 can still add.
+const s32 ENUMERATION_RUNGS = 11;
+
+struct FrameEnumeration {
+    const u8 *input;
+    const s32 *lastState;
+    s16 *guess;
+    const Codebook &book;
+    SearchBudget budget;
+    s32 ladder[16][ENUMERATION_RUNGS];
+    s32 rungs[16];
+    s32 capacity[17];
+
+    bool visit(s32 pos, s32 remaining) {
+        if (pos == 16) {
+            return remaining == 0 && budget.take() && encodes_to(input, guess, lastState, book);
+        }
+        if (remaining > capacity[pos] || budget.exhausted()) {
+            return false;
+        }
+        for (s32 rung = 0; rung <= min(remaining, rungs[pos] - 1); rung++) {
+            guess[pos] = ladder[pos][rung];
+            if (visit(pos + 1, remaining - rung)) {
+                return true;
+            }
+        }
+        guess[pos] = ladder[pos][0];
+        return false;
+    }
+};
+
+bool enumerate_frame(const u8 *input, const s32 *lastState, const s32 *decoded, const s16 *origGuess,
+                     s16 *guess, const Codebook &book, const RoundtripBudget &budget) {
+    s32 lo[16], hi[16];
+    if (!frame_intervals(input, decoded, lo, hi)) {
+        return false;
+    }
+
+    FrameEnumeration search{ input, lastState, guess, book, SearchBudget(budget), {}, {}, {} };
+    for (s32 i = 15; i >= 0; i--) {
+        s32 base = clamp(static_cast<s32>(origGuess[i]), lo[i], hi[i]), width = hi[i] - lo[i];
+        s32 candidates[ENUMERATION_RUNGS + 1] = { base, base - 1, base + 1 };
+        for (s32 k = 0; k <= ENUMERATION_RUNGS - 3; k++) {
+            candidates[3 + k] =
+                lo[i] + static_cast<s32>(static_cast<int64_t>(width) * k / (ENUMERATION_RUNGS - 3));
+        }
+        stable_sort(candidates, candidates + ENUMERATION_RUNGS, [base](s32 a, s32 b) {
+            return abs(a - base) < abs(b - base);
+        });
+
+        s32 &count = search.rungs[i], *ladder = search.ladder[i];
+        count = 0;
+        for (s32 k = 0; k < ENUMERATION_RUNGS; k++) {
+            s32 value = candidates[k];
+            if (value >= lo[i] && value <= hi[i]
+                && find(ladder, ladder + count, value) == ladder + count) {
+                ladder[count++] = value;
+            }
+        }
+        guess[i] = base;
+        search.capacity[i] = search.capacity[i + 1] + count - 1;
+    }
+
+    for (s32 distance = 0; distance <= search.capacity[0]; distance++) {
+        if (search.visit(0, distance)) {
+            return true;
+        }
+        if (search.budget.exhausted()) {
+            break;
+        }
+    }
+    return false;
+}
+
+// Finds a 16-bit PCM frame that re-encodes to `input`. `lastState` is the decoder state before the
+// frame and `decoded` the state after it; neither depends on which guess is chosen, so frames can be
+// searched independently of each other.
+RoundtripResult roundtrip_frame(const u8 *input, const s32 *lastState, const s32 *decoded, s16 *guess,
+                                const Codebook &book, u64 randState,
+                                const RoundtripBudget &budget) {
+    s16 origGuess[16];
+
+    // Create a guess from the real decode, by clamping to 16 bits
+    for (s32 i = 0; i < 16; i++) {
+        origGuess[i] = clamp_to_s16(decoded[i]);
+    }
+
+    // Encode the guess
+    memcpy(guess, origGuess, sizeof(origGuess));
+    if (encodes_to(input, guess, lastState, book)) {
+        return ROUNDTRIP_EXACT;
+    }
+
+    // If it doesn't match, solve for a frame that does
+    if (solve_frame(input, lastState, decoded, origGuess, guess, book, randState)) {
+        return ROUNDTRIP_SOLVED;
+    }
+
+    // Should that fail, randomly round numbers until it does, within the budget. Candidates are
+    // drawn and encoded ENCODE_LANES at a time; the random state after each one is kept so the
+    // search continues exactly as if they had been tried one by one.
+    s32 scale = 1 << (input[0] >> 4);
+    s16 candidates[ENCODE_LANES][16];
+    u64 randStates[ENCODE_LANES];
+    auto tries = SearchBudget(budget);
+    bool matched = false;
+    for (s32 width = 1; !matched && !tries.exhausted(); width = std::min(width * 2, ENCODE_LANES)) {
+        s32 count = 0;
+        while (count < width && tries.take()) {
+            permute(candidates[count], decoded, scale, &randState);
+            randStates[count++] = randState;
+        }
+        u32 mask = encode_matches(input, candidates, count, lastState, book);
+        if (mask != 0) {
+            s32 lane = countr_zero(mask);
+            memcpy(guess, candidates[lane], sizeof(candidates[lane]));
+            randState = randStates[lane];
+            matched = true;
+        }
+    }
+
+    // Out of budget, walk outwards from the original decode instead. If even that runs dry the
+    // frame is left as the clamped decode and reported, since it won't re-encode.
+    if (!matched) {
+        if (enumerate_frame(input, lastState, decoded, origGuess, guess, book, budget)) {
+            return ROUNDTRIP_ENUMERATED;
+        }
+        memcpy(guess, origGuess, sizeof(origGuess));
+        return ROUNDTRIP_FAILED;
+    }
+
+    // Bring the matching closer to the original decode (not strictly
+    // necessary, but it will move us closer to the target on average).
+    // Every step only tries a single change to the current guess, so a batch of steps can be
+    // drawn up front against it: everything before the first match would have been undone anyway.
+    for (s32 failures = 0, width = 1; failures < 50;) {
+        s32 count = 0, f = failures;
+        u64 rs = randState;
+        for (; count < width && f < 50; f++) {
+            s32 ind = myrand(&rs) % 16;
+            s32 old = guess[ind];
+            if (old == origGuess[ind]) {
+                continue;
             }
+            memcpy(candidates[count], guess, sizeof(candidates[count]));
+            candidates[count][ind] = origGuess[ind];
+            if (myrand(&rs) % 2) {
+                candidates[count][ind] += (old - origGuess[ind]) / 2;
+            }
+            randStates[count++] = rs;
         }
+        u32 mask = count ? encode_matches(input, candidates, count, lastState, book) : 0;
+        if (mask != 0) {
+            s32 lane = countr_zero(mask);
+            memcpy(guess, candidates[lane], sizeof(candidates[lane]));
+            randState = randStates[lane];
+            failures = 0;
+            width = 1;
+        } else {
+            randState = rs;
+            failures = f;
+            width = std::min(width * 2, ENCODE_LANES);
+        }
+    }
+    return ROUNDTRIP_RANDOM;
+}
+
+void write_header(vector<byte> &aiffData, size_t *ofile, const char *id, s32 size) {
+    write_bytes_to_vec(id, 4, 1, aiffData, ofile);
+    BSWAP32(size);
+    write_bytes_to_vec(&size, sizeof(s32), 1, aiffData, ofile);
+}
+
+// A decoded AIFF file, kept as the two pieces it is produced in: every chunk up to and including the
+// SSND header, and the PCM that makes up the rest of SSND and ends the file. write_aiff_image() sends
+// both with one writev(), so the samples are never copied behind the header.
+struct AiffImage {
+    vector<byte> header, samples;
 
-        memcpy(state, decoded, sizeof(lastState));
-        BSWAP16_MANY(guess, 16);
-        memcpy(outputBuf.data() + currPos * 2, guess, sizeof(guess));
-        currPos += 16;
+    bool empty(void) const {
+        return header.empty();
     }
 
-    // Write an incomplete file header. We'll fill in the size later.
-    write_bytes_to_vec("FORM\0\0\0\0AIFF", 12, 1, aiffData, &outputBufferPosition);
+    // COMM is always the first chunk, so its sample rate sits at a fixed offset
+    void set_sample_rate(span<const byte> rate) {
+        assert(header.size() >= 38 && memcmp(header.data() + 12, "COMM", 4) == 0 && rate.size() == 10);
+        memcpy(header.data() + 28, rate.data(), rate.size());
+    }
+};
+
+int write_aiff_image(int fd, const AiffImage &image) {
+    iovec iov[2] = {
+        { const_cast<byte *>(image.header.data()), image.header.size() },
+        { const_cast<byte *>(image.samples.data()), image.samples.size() },
+    };
+    return write_fully(fd, iov, 2);
+}
+
+// The main routine of aifc_decode.c, minus the AIFF-C container: decodes a bare VADPCM payload with
+// its parsed book and loop straight into an AIFF file, which is how samples taken from the ROM come.
+// `loop` may be null, and `sampleRate` is the 80-bit float exactly as it goes into COMM.
+AiffImage decode_vadpcm(const Codebook &book, const ALADPCMLoop *loop, span<const byte> payload,
+                        s32 nSamples, span<const byte> sampleRate, ThreadPool &pool,
+                        const RoundtripBudget &budget,
+                        vector<pair<size_t, RoundtripResult>> &fallbacks) {
+    s32 order = book.order, npredictors = book.npredictors;
+    s32 state[16] = {};
+    CommonChunk CommChunk;
+    InstrumentChunk InstChunk;
+    SoundDataChunk SndDChunk;
+
+    AiffImage aiff;
+    vector<byte> &aiffData = aiff.header;
+    size_t outputBufferPosition = 0;
+
+    assert(sampleRate.size() == sizeof(CommChunk.sampleRate));
+    assert(nSamples % 16 == 0);
+
+    if (order < 1 || order > 8) {
+        cerr << "Unsupported codebook order " << order << endl;
+        return aiff;
+    }
+
+    if (payload.size() < static_cast<size_t>(nSamples / 16) * 9) {
+        cerr << "Sound data holds " << payload.size() / 9 << " frames, expected " << nSamples / 16
+             << endl;
+        return aiff;
+    }
+
+    // Every chunk size is known before anything is decoded, so the header is allocated exactly once
+    const size_t markSize = 2 + 2 * sizeof(Marker) + 1 + 5 + 1 + 3;
+    const size_t applSize = 4 + 12 + sizeof(CodeChunk) + npredictors * order * 8 * 2;
+    const size_t headerSize = 12 + 8 + (sizeof(CommonChunk) - 4)
+                              + (loop != nullptr ? 8 + markSize + 8 + sizeof(InstrumentChunk) : 0)
+                              + 8 + applSize + 8 + sizeof(SoundDataChunk);
+    u32 outputBytes = nSamples * sizeof(s16);
+    aiffData.resize(headerSize);
+
+    // Write the file header, its size covers the samples that will follow it
+    s32 fileSize = headerSize + outputBytes - 8;
+    write_header(aiffData, &outputBufferPosition, "FORM", fileSize);
+    write_bytes_to_vec("AIFF", 4, 1, aiffData, &outputBufferPosition);
 
     // Subtract 4 from the COMM size to skip the compression field.
     write_header(aiffData, &outputBufferPosition, "COMM", sizeof(CommonChunk) - 4);
-    CommChunk.numFramesH = nSamples >> 16;
-    CommChunk.numFramesL = nSamples & 0xffff;
-    BSWAP16(CommChunk.numChannels);
-    BSWAP16(CommChunk.numFramesH);
-    BSWAP16(CommChunk.numFramesL);
-    BSWAP16(CommChunk.sampleSize);
+    CommChunk.numChannels = bswap16(1);
+    CommChunk.numFramesH = bswap16(nSamples >> 16);
+    CommChunk.numFramesL = bswap16(nSamples & 0xffff);
+    CommChunk.sampleSize = bswap16(16);
+    memcpy(CommChunk.sampleRate, sampleRate.data(), sizeof(CommChunk.sampleRate));
     write_bytes_to_vec(&CommChunk, sizeof(CommonChunk) - 4, 1, aiffData, &outputBufferPosition);
 
-    if (nloops > 0) {
-        s32 startPos = aloops[0].start, endPos = aloops[0].end;
+    if (loop != nullptr) {
+        s32 startPos = loop->start, endPos = loop->end;
         const char *markerNames[2] = { "start", "end" };
         Marker markers[2] = {
             { 1, static_cast<u16>(startPos >> 16), static_cast<u16>(startPos & 0xffff) },
             { 2, static_cast<u16>(endPos >> 16), static_cast<u16>(endPos & 0xffff) }
         };
-        write_header(aiffData, &outputBufferPosition, "MARK", 2 + 2 * sizeof(Marker) + 1 + 5 + 1 + 3);
+        write_header(aiffData, &outputBufferPosition, "MARK", markSize);
         s16 numMarkers = bswap16(2);
         write_bytes_to_vec(&numMarkers, sizeof(s16), 1, aiffData, &outputBufferPosition);
         for (s32 i = 0; i < 2; i++) {
@@ -1015,20 +2540,17 @@ vector<byte> decode_aifc(const vector<byte> &aifcData) {
         }
 
         write_header(aiffData, &outputBufferPosition, "INST", sizeof(InstrumentChunk));
+        memset(&InstChunk, 0, sizeof(InstChunk));
         InstChunk.sustainLoop.playMode = bswap16(1);
         InstChunk.sustainLoop.beginLoop = bswap16(1);
         InstChunk.sustainLoop.endLoop = bswap16(2);
-        InstChunk.releaseLoop.playMode = 0;
-        InstChunk.releaseLoop.beginLoop = 0;
-        InstChunk.releaseLoop.endLoop = 0;
         write_bytes_to_vec(&InstChunk, sizeof(InstrumentChunk), 1, aiffData, &outputBufferPosition);
     }
 
     // Save the coefficient table for use when encoding. Ideally this wouldn't
     // be needed and "tabledesign -s 1" would generate the right table, but in
     // practice it's difficult to adjust samples to make that happen.
-    write_header(aiffData, &outputBufferPosition, "APPL",
-                 4 + 12 + sizeof(CodeChunk) + npredictors * order * 8 * 2);
+    write_header(aiffData, &outputBufferPosition, "APPL", applSize);
     write_bytes_to_vec("stoc", 4, 1, aiffData, &outputBufferPosition);
     CodeChunk cChunk;
     cChunk.version = bswap16(1);
@@ -1039,7 +2561,7 @@ vector<byte> decode_aifc(const vector<byte> &aifcData) {
     for (s32 i = 0; i < npredictors; i++) {
         for (s32 j = 0; j < order; j++) {
             for (s32 k = 0; k < 8; k++) {
-                s16 ts = bswap16(coefTable[i][k][j]);
+                s16 ts = bswap16(book.row(i, k)[j]);
                 write_bytes_to_vec(&ts, sizeof(s16), 1, aiffData, &outputBufferPosition);
             }
         }
@@ -1049,20 +2571,62 @@ vector<byte> decode_aifc(const vector<byte> &aifcData) {
     SndDChunk.offset = 0;
     SndDChunk.blockSize = 0;
     write_bytes_to_vec(&SndDChunk, sizeof(SoundDataChunk), 1, aiffData, &outputBufferPosition);
-    write_bytes_to_vec(outputBuf.data(), outputBytes, 1, aiffData, &outputBufferPosition);
 
-    // Fix the size in the header
-    s32 fileSize = bswap32(outputBufferPosition - 8);
-    outputBufferPosition = 4;
-    write_bytes_to_vec(&fileSize, 4, 1, aiffData, &outputBufferPosition);
+    assert(outputBufferPosition == headerSize);
+
+    aiff.samples.resize(outputBytes);
+
+    // The real decode is cheap but sequential, so run it first and keep the state going into every
+    // frame. Only its last `order` samples are ever read, and from those each frame decodes the same
+    // again on its own, so the roundtrip search then runs across the pool.
+    size_t numFrames = nSamples / 16;
+    vector<s32> history(numFrames * order);
+
+    for (size_t i = 0; i < numFrames; i++) {
+        const u8 *input = reinterpret_cast<const u8 *>(payload.data()) + i * 9;
+        memcpy(&history[i * order], &state[16 - order], order * sizeof(s32));
+        if ((input[0] & 0xf) >= npredictors) {
+            cerr << "Frame uses predictor " << (input[0] & 0xf) << " of " << npredictors << endl;
+            return AiffImage();
+        }
+
+        // Decode for real
+        decode_frame(input, state, book);
+    }
+
+    mutex lock;
+    size_t reported = fallbacks.size();
+    pool.parallel_for(
+        numFrames,
+        [&](size_t i) {
+            const u8 *input = reinterpret_cast<const u8 *>(payload.data()) + i * 9;
+            s32 lastState[16] = {}, decoded[16];
+            s16 guess[16];
+            memcpy(&lastState[16 - order], &history[i * order], order * sizeof(s32));
+            memcpy(decoded, lastState, sizeof(lastState));
+            decode_frame(input, decoded, book);
+
+            RoundtripResult result = roundtrip_frame(input, lastState, decoded, guess, book,
+                                                     myrand_seed(i), budget);
+            BSWAP16_MANY(guess, 16);
+            memcpy(aiff.samples.data() + i * sizeof(guess), guess, sizeof(guess));
+            if (result > ROUNDTRIP_SOLVED) {
+                lock_guard<mutex> held(lock);
+                fallbacks.emplace_back(i, result);
+            }
+        },
+        64);
+    sort(fallbacks.begin() + reported, fallbacks.end());
 
-    return aiffData;
+    return aiff;
 }
+
 // End translated aifc_decode.c
 
 // End utilities
 
 // Classes
+
 class Sound {
   public:
     uint32_t sample_addr = 0;
@@ -1080,7 +2644,7 @@ class Sound {
 
     Sound &operator=(const Sound &sound) = default;
 
-    Sound(const vector<byte> &data) {
+    Sound(span<const byte> data) {
         sample_addr = READ_32_BITS(data, 0);
         tuning = static_cast<double>(bit_cast<float>(READ_32_BITS(data, 4)));
         if (sample_addr == 0) {
@@ -1104,13 +2668,13 @@ class Drum {
 
     Drum &operator=(const Drum &drum) = default;
 
-    Drum(const vector<byte> &data) {
+    Drum(span<const byte> data) {
         byte loaded = data[2], pad = data[3];
         uint32_t envelope_addr = READ_32_BITS(data, 12);
         assert(static_cast<uint8_t>(loaded) == 0);
         assert(static_cast<uint8_t>(pad) == 0);
         assert(envelope_addr != 0);
-        sound = Sound({ data.begin() + 4, data.begin() + 12 });
+        sound = Sound(data.subspan(4, 8));
     }
 };
 
@@ -1132,13 +2696,13 @@ class Instrument {
 
     Instrument &operator=(const Instrument &instrmnt) = default;
 
-    Instrument(const vector<byte> &data) {
+    Instrument(span<const byte> data) {
         byte normal_range_lo = data[1], normal_range_hi = data[2];
         uint32_t envelope_addr = READ_32_BITS(data, 4);
         assert(envelope_addr != 0);
-        sound_lo = Sound({ data.begin() + 8, data.begin() + 16 });
-        sound_med = Sound({ data.begin() + 16, data.begin() + 24 });
-        sound_hi = Sound({ data.begin() + 24, data.end() });
+        sound_lo = Sound(data.subspan(8, 8));
+        sound_med = Sound(data.subspan(16, 8));
+        sound_hi = Sound(data.subspan(24, 8));
         if (sound_lo.sample_addr == 0) {
             assert(static_cast<uint8_t>(normal_range_lo) == 0);
         }
@@ -1152,29 +2716,37 @@ class Book {
   public:
     int16_t order, npredictors;
     vector<int16_t> table;
+    // The table expanded for decoding, built once here rather than for every frame
+    Codebook codebook;
 
     Book(const uint32_t order, const uint32_t npredictors, const vector<int16_t> &table)
-        : order(order), npredictors(npredictors), table(table) {
+        : order(order), npredictors(npredictors), table(table),
+          codebook(order, npredictors, table.data()) {
     }
 
     Book(const Book &b) {
         order = b.order;
         npredictors = b.npredictors;
         table = b.table;
+        codebook = b.codebook;
     }
 
+    Book(Book &&b) = default;
+
     Book() = default;
 
     Book &operator=(const Book &book) = default;
 
-    Book(const uint32_t addr, const vector<byte> &bank_data) {
+    Book(const uint32_t addr, span<const byte> bank_data) {
         order = READ_32_BITS(bank_data, addr);
         npredictors = READ_32_BITS(bank_data, addr + 4);
         assert(order == 2);
         assert(npredictors == 2);
+        table.reserve(8 * order * npredictors);
         for (int32_t i = 0; i < 16 * order * npredictors; i += 2) {
             table.push_back(READ_16_BITS(bank_data, addr + 8 + i));
         }
+        codebook = Codebook(order, npredictors, table.data());
     }
 };
 
@@ -1190,7 +2762,7 @@ ALADPCMLoop::ALADPCMLoop(const ALADPCMLoop &l) {
     state = l.state;
 }
 
-ALADPCMLoop::ALADPCMLoop(const uint32_t addr, const vector<byte> &bank_data) {
+ALADPCMLoop::ALADPCMLoop(const uint32_t addr, span<const byte> bank_data) {
     start = READ_32_BITS(bank_data, addr);
     end = READ_32_BITS(bank_data, addr + 4);
     count = READ_32_BITS(bank_data, addr + 8);
@@ -1199,35 +2771,113 @@ ALADPCMLoop::ALADPCMLoop(const uint32_t addr, const vector<byte> &bank_data) {
     if (!count) {
         return;
     }
+    state.reserve(16);
     for (size_t i = 0; i < 32; i += 2) {
         state.push_back(READ_16_BITS(bank_data, addr + 16 + i));
     }
 }
 
+// One distinct sample: the ADPCM payload together with the book and loop it is decoded with. `id`
+// hashes all three and identifies the sample everywhere else. A sample is extracted once for every
+// name it has, each with the tunings of the sounds that play it under that name.
 class AifcEntry {
   public:
-    string filename;
+    struct Name {
+        string filename;
+        vector<double> tunings;
+    };
+
+    CacheKey id;
     vector<byte> data;
     Book book;
     ALADPCMLoop loop;
-    vector<double> tunings;
+    vector<Name> names;
 
-    AifcEntry(const string &filename, const vector<byte> &data, const Book &book,
-              const ALADPCMLoop &loop, const vector<double> &tunings)
-        : filename(filename), data(data), book(book), loop(loop), tunings(tunings) {
+    AifcEntry(const CacheKey &id, vector<byte> &&data, Book &&book, ALADPCMLoop &&loop)
+        : id(id), data(move(data)), book(move(book)), loop(move(loop)) {
     }
 
     AifcEntry(const AifcEntry &ae) {
-        filename = ae.filename;
+        id = ae.id;
         data = ae.data;
         book = ae.book;
         loop = ae.loop;
-        tunings = ae.tunings;
+        names = ae.names;
     }
 
+    AifcEntry(AifcEntry &&ae) = default;
+
     AifcEntry() = default;
 };
 
+// SampleRegistry
+// Every distinct sample across all banks, keyed by AifcEntry::id instead of by the ROM address of
+// whichever ctl entry points at it. Banks only keep indices into it, so a sample reached through
+// several banks or ctl entries is parsed, decoded and written once.
+class SampleRegistry {
+  public:
+    vector<AifcEntry> samples;
+
+    size_t add(span<const byte> payload, uint32_t book_addr, uint32_t loop_addr,
+               span<const byte> bank_data);
+    void name(size_t index, string_view filename, span<const double> tunings);
+
+  private:
+    struct IdHash {
+        size_t operator()(const CacheKey &id) const {
+            return id.words[0];
+        }
+    };
+
+    unordered_map<CacheKey, size_t, IdHash> by_id;
+    unordered_map<string, size_t> by_filename;
+};
+
+// Index of the sample with this payload and the book and loop at these addresses of the bank, which
+// is added if it hasn't been seen yet. The id hashes the book and loop as they are stored in the ROM,
+// so the Book and ALADPCMLoop are only parsed for a sample that is new.
+size_t SampleRegistry::add(span<const byte> payload, uint32_t book_addr, uint32_t loop_addr,
+                           span<const byte> bank_data) {
+    uint32_t order = READ_32_BITS(bank_data, book_addr);
+    uint32_t npredictors = READ_32_BITS(bank_data, book_addr + 4);
+    uint32_t count = READ_32_BITS(bank_data, loop_addr + 8);
+    auto book = bank_data.subspan(book_addr, 8 + 16 * order * npredictors);
+    auto loop = bank_data.subspan(loop_addr, count ? 48 : 16);
+
+    CacheKey id;
+    id.add(payload);
+    id.add(book);
+    id.add(loop);
+
+    auto [it, added] = by_id.try_emplace(id, samples.size());
+    if (!added) {
+        const AifcEntry &known = samples[it->second];
+        assert(equal(known.data.begin(), known.data.end(), payload.begin(), payload.end()));
+        assert(known.book.order == static_cast<int16_t>(order) && known.loop.count == count);
+        return it->second;
+    }
+
+    samples.emplace_back(id, vector<byte>(payload.begin(), payload.end()), Book(book_addr, bank_data),
+                         ALADPCMLoop(loop_addr, bank_data));
+    return it->second;
+}
+
+// Adds `filename` to the names sample `index` is extracted under. A filename always names the same
+// sample; the tunings of its first sighting are the ones used.
+void SampleRegistry::name(size_t index, string_view filename, span<const double> tunings) {
+    if (filename.empty()) {
+        // no filename of its own, another ctl entry names it
+        return;
+    }
+
+    auto [it, added] = by_filename.try_emplace(string(filename), index);
+    assert(it->second == index);
+    if (added) {
+        samples[index].names.push_back({ string(filename), { tunings.begin(), tunings.end() } });
+    }
+}
+// End SampleRegistry
+
 class BankHeader {
   public:
     uint32_t num_instrmts, num_drums;
@@ -1242,7 +2892,7 @@ class BankHeader {
 
     BankHeader() = default;
 
-    BankHeader(const vector<byte> &header) {
+    BankHeader(span<const byte> header) {
         num_instrmts = READ_32_BITS(header, 0);
         num_drums = READ_32_BITS(header, 4);
         uint32_t shared = READ_32_BITS(header, 8);
@@ -1252,42 +2902,55 @@ class BankHeader {
 };
 
 // SampleBank
+// What SampleBank::parse_ctl() collects from a ctl entry, kept from one entry to the next so that
+// parsing only allocates for what the banks and the SampleRegistry keep
+struct CtlScratch {
+    vector<uint32_t> drum_addrs, instrmt_addrs, sorted_addrs;
+    vector<Instrument> instrmts;
+    vector<Drum> drums;
+    // (sample address, position, tuning) of every sound that plays a sample
+    vector<tuple<uint32_t, uint32_t, double>> sounds;
+    vector<double> tunings;
+};
+
 class SampleBank {
   public:
     uint32_t bank_index;
     vector<uint32_t> ctl_indices;
-    vector<AifcEntry> entries;
+    // indices into the SampleRegistry of every sample the bank's instruments and drums play
+    vector<size_t> samples;
 
-    SampleBank(const uint32_t bank_index, const vector<byte> &data)
+    SampleBank(const uint32_t bank_index, span<const byte> data)
         : bank_index(bank_index), data(data) {
     }
 
     SampleBank(const SampleBank &sb) {
         bank_index = sb.bank_index;
         ctl_indices = sb.ctl_indices;
+        samples = sb.samples;
+        known_samples = sb.known_samples;
         data = sb.data;
     }
 
     SampleBank() = default;
 
-    void parse_sample(const vector<byte> &sample_data, const vector<byte> &bank_data,
-                      const vector<double> &tunings, const string &filename);
+    void parse_sample(span<const byte> sample_data, span<const byte> bank_data,
+                      span<const double> tunings, string_view filename, SampleRegistry &registry);
 
-    void parse_ctl(const BankHeader &parsed_header, const vector<byte> &data,
-                   map<const uint32_t, const string> &address_to_filename, const uint32_t offset);
+    void parse_ctl(const BankHeader &parsed_header, span<const byte> data,
+                   const AddressTable &address_to_filename, const uint32_t offset,
+                   SampleRegistry &registry, CtlScratch &scratch);
 
   private:
-    vector<byte> data;
+    // view into the tbl region of the ROM, which outlives every SampleBank
+    span<const byte> data;
+    // the contents of `samples`, so that each ctl entry's samples are added without scanning it
+    unordered_set<size_t> known_samples;
 };
 
-void SampleBank::parse_sample(const vector<byte> &sample_data, const vector<byte> &bank_data,
-                              const vector<double> &tunings, const string &filename) {
-
-    if (filename == "") {
-        // duplicate sample, not necessary
-        return;
-    }
-
+void SampleBank::parse_sample(span<const byte> sample_data, span<const byte> bank_data,
+                              span<const double> tunings, string_view filename,
+                              SampleRegistry &registry) {
     uint32_t zero = READ_32_BITS(sample_data, 0), addr = READ_32_BITS(sample_data, 4),
              raw_loop = READ_32_BITS(sample_data, 8), raw_book = READ_32_BITS(sample_data, 12),
              sample_size = READ_32_BITS(sample_data, 16);
@@ -1301,40 +2964,22 @@ void SampleBank::parse_sample(const vector<byte> &sample_data, const vector<byte
         sample_size -= 1;
     }
 
-    Book book(raw_book, bank_data);
-    ALADPCMLoop loop(raw_loop, bank_data);
-
-    AifcEntry *already_parsed_entry = nullptr;
-    for (auto &entry : entries) {
-        if (filename == entry.filename) {
-            already_parsed_entry = &entry;
-            break;
-        }
-    }
-
-    if (already_parsed_entry != nullptr) {
-        assert(already_parsed_entry->book.order == book.order);
-        assert(already_parsed_entry->book.npredictors == book.npredictors);
-        assert(already_parsed_entry->book.table == book.table);
-        assert(already_parsed_entry->loop.start == loop.start);
-        assert(already_parsed_entry->loop.end == loop.end);
-        assert(already_parsed_entry->loop.count == loop.count);
-        assert(already_parsed_entry->loop.state == loop.state);
-        assert(already_parsed_entry->data.size() == sample_size);
-        return;
+    // Samples without a filename of their own are registered too, so that every bank refers to the
+    // one copy however its ctl entry happens to reach it
+    size_t index = registry.add(data.subspan(addr, sample_size), raw_book, raw_loop, bank_data);
+    registry.name(index, filename, tunings);
+    if (known_samples.insert(index).second) {
+        samples.push_back(index);
     }
-
-    const auto aifc_data = vector<byte>(data.begin() + addr, data.begin() + addr + sample_size);
-    auto entry = AifcEntry(filename, aifc_data, book, loop, tunings);
-    entries.push_back(entry);
 }
 
-void SampleBank::parse_ctl(const BankHeader &parsed_header, const vector<byte> &bank_data,
-                           map<const uint32_t, const string> &address_to_filename,
-                           const uint32_t offset) {
+void SampleBank::parse_ctl(const BankHeader &parsed_header, span<const byte> bank_data,
+                           const AddressTable &address_to_filename, const uint32_t offset,
+                           SampleRegistry &registry, CtlScratch &scratch) {
     uint32_t drum_base_addr = READ_32_BITS(bank_data, 0);
-    vector<uint32_t> drum_addrs;
+    auto &drum_addrs = scratch.drum_addrs, &instrmt_addrs = scratch.instrmt_addrs;
 
+    drum_addrs.clear();
     if (parsed_header.num_drums != 0) {
         assert(drum_base_addr != 0);
         for (size_t i = 0; i < parsed_header.num_drums; i++) {
@@ -1347,14 +2992,11 @@ void SampleBank::parse_ctl(const BankHeader &parsed_header, const vector<byte> &
     }
 
     uint32_t instrmt_base_addr = 4;
-    vector<uint32_t> instrmt_addrs, instrmt_list(parsed_header.num_instrmts, 0);
+    instrmt_addrs.clear();
 
     for (size_t i = 0; i < parsed_header.num_instrmts; i++) {
         uint32_t instrmt_addr = READ_32_BITS(bank_data, instrmt_base_addr + i * 4);
-        if (instrmt_addr == 0) {
-            instrmt_list[i] = 0;
-        } else {
-            instrmt_list[i] = instrmt_addr;
+        if (instrmt_addr != 0) {
             instrmt_addrs.push_back(instrmt_addr);
         }
     }
@@ -1364,128 +3006,95 @@ void SampleBank::parse_ctl(const BankHeader &parsed_header, const vector<byte> &
                < *min_element(drum_addrs.begin(), drum_addrs.end()));
     }
 
-    assert(set<uint32_t>(instrmt_addrs.begin(), instrmt_addrs.end()).size() == instrmt_addrs.size());
-    assert(set<uint32_t>(drum_addrs.begin(), drum_addrs.end()).size() == drum_addrs.size());
+    for (const auto *addrs : { &instrmt_addrs, &drum_addrs }) {
+        scratch.sorted_addrs.assign(addrs->begin(), addrs->end());
+        sort(scratch.sorted_addrs.begin(), scratch.sorted_addrs.end());
+        assert(adjacent_find(scratch.sorted_addrs.begin(), scratch.sorted_addrs.end())
+               == scratch.sorted_addrs.end());
+    }
 
-    vector<Instrument> instrmts;
+    auto &instrmts = scratch.instrmts;
+    instrmts.clear();
     for (uint32_t instrmt_addr : instrmt_addrs) {
-        auto instrmt = Instrument(
-            vector<byte>(bank_data.begin() + instrmt_addr, bank_data.begin() + instrmt_addr + 32));
-        instrmts.push_back(instrmt);
+        instrmts.emplace_back(bank_data.subspan(instrmt_addr, 32));
     }
 
-    vector<Drum> drums;
+    auto &drums = scratch.drums;
+    drums.clear();
     for (uint32_t drum_addr : drum_addrs) {
-        auto drum =
-            Drum(vector<byte>(bank_data.begin() + drum_addr, bank_data.begin() + drum_addr + 16));
-        drums.push_back(drum);
+        drums.emplace_back(bank_data.subspan(drum_addr, 16));
     }
 
-    set<uint32_t> sample_addrs;
-    map<uint32_t, vector<double>> tunings;
+    // sorted by sample address, and for each sample in the order the sounds come in
+    auto &sounds = scratch.sounds;
+    sounds.clear();
 
     for (const auto &instrmt : instrmts) {
         for (const auto &sound : { instrmt.sound_lo, instrmt.sound_med, instrmt.sound_hi }) {
             if (sound.sample_addr != 0) {
-                sample_addrs.insert(sound.sample_addr);
-                tunings[sound.sample_addr].push_back(sound.tuning);
+                sounds.emplace_back(sound.sample_addr, sounds.size(), sound.tuning);
             }
         }
     }
 
     for (const auto &drum : drums) {
-        sample_addrs.insert(drum.sound.sample_addr);
-        tunings[drum.sound.sample_addr].push_back(drum.sound.tuning);
+        sounds.emplace_back(drum.sound.sample_addr, sounds.size(), drum.sound.tuning);
     }
 
-    for (const auto addr : sample_addrs) {
+    sort(sounds.begin(), sounds.end());
+    for (size_t first = 0, last; first < sounds.size(); first = last) {
+        uint32_t addr = get<0>(sounds[first]);
+        scratch.tunings.clear();
+        for (last = first; last < sounds.size() && get<0>(sounds[last]) == addr; last++) {
+            scratch.tunings.push_back(get<2>(sounds[last]));
+        }
+
         uint32_t sample_size = 20;
-        const auto sample_data =
-            vector<byte>(bank_data.begin() + addr, bank_data.begin() + addr + sample_size);
-        parse_sample(sample_data, bank_data, tunings[addr], address_to_filename[offset + addr]);
+        const auto sample_data = bank_data.subspan(addr, sample_size);
+        parse_sample(sample_data, bank_data, scratch.tunings, address_to_filename[offset + addr],
+                     registry);
     }
 }
 // End SampleBank
 
 // AiffWriter
+// Writes one sample under each of its names. The first name that isn't served from the cache decodes
+// the sample, and every later one reuses that decode with only the COMM sample rate changed.
 class AiffWriter {
   public:
-    AiffWriter(ofstream &out) : out(out) {
+    AiffWriter(const AifcEntry &entry, ThreadPool &pool, const RoundtripBudget &budget,
+               const ArtifactCache &cache, vector<pair<size_t, RoundtripResult>> &fallbacks)
+        : entry(entry), pool(pool), budget(budget), cache(cache), fallbacks(fallbacks) {
     }
 
-    void add_section(const string &tp, const vector<byte> &data);
-    void add_custom_section(const string &tp, const vector<byte> &data);
-    void write(const AifcEntry &entry);
-    void finish(void);
-
-  private:
-    ofstream &out;
-    vector<pair<string, vector<byte>>> sections;
-};
+    static CacheKey key(const AifcEntry &entry, const AifcEntry::Name &name);
+    int write(int fd, const AifcEntry::Name &name, const CacheKey &key);
 
-void AiffWriter::add_section(const string &tp, const vector<byte> &data) {
-    sections.emplace_back(tp, data);
-}
-
-void AiffWriter::add_custom_section(const string &tp, const vector<byte> &data) {
-    string stoc_string = "stoc";
-    vector<byte> custom_data(stoc_string.size()), tp_data = pstring(tp);
-    transform(stoc_string.begin(), stoc_string.end(), custom_data.begin(), INTO_BYTES);
-    custom_data.insert(custom_data.end(), tp_data.begin(), tp_data.end());
-    custom_data.insert(custom_data.end(), data.begin(), data.end());
-    add_section("APPL", custom_data);
-}
-
-void AiffWriter::finish(void) {
-    string form_string = "FORM", aifc_string = "AIFC";
-
-    // total_size_pad is a place where some .aiff files have size information but it's
-    // not necessary for this game
-    vector<byte> form_chars(form_string.size()), aifc_chars(aifc_string.size()),
-        total_size_pad(4, static_cast<byte>(0)), out_vec;
-    transform(form_string.begin(), form_string.end(), form_chars.begin(), INTO_BYTES);
-    transform(aifc_string.begin(), aifc_string.end(), aifc_chars.begin(), INTO_BYTES);
-    out_vec.insert(out_vec.end(), form_chars.begin(), form_chars.end());
-    out_vec.insert(out_vec.end(), total_size_pad.begin(), total_size_pad.end());
-    out_vec.insert(out_vec.end(), aifc_chars.begin(), aifc_chars.end());
-
-    for (const auto &[tp, data] : sections) {
-        vector<byte> tp_chars(tp.size());
-        transform(tp.begin(), tp.end(), tp_chars.begin(), INTO_BYTES);
-        out_vec.insert(out_vec.end(), tp_chars.begin(), tp_chars.end());
-        uint32_t size = data.size();
-        vector<byte> size_bytes(4);
-        WRITE_32_BITS(size, size_bytes, 0);
-        out_vec.insert(out_vec.end(), size_bytes.begin(), size_bytes.end());
-        out_vec.insert(out_vec.end(), data.begin(), data.end());
-        if (size % 2) {
-            out_vec.insert(out_vec.end(), static_cast<byte>('\0'));
-        }
+    // Whether the decode needed the fallback search, which makes it depend on the search budget
+    bool needed_fallbacks(void) const {
+        return !exact;
     }
 
-    auto aiff = decode_aifc(out_vec);
-
-    out.write(reinterpret_cast<const char *>(aiff.data()), aiff.size());
-    out.close();
-}
-
-void AiffWriter::write(const AifcEntry &entry) {
-    int16_t num_channels = 1, sample_size = 16;
-    auto data = entry.data;
-    assert(data.size() % 9 == 0);
-    if (data.size() % 2) {
-        data.push_back(static_cast<byte>('\0'));
-    }
-    // (Computing num_frames this way makes it off by one when the data length
-    // is odd. It matches vadpcm_enc, though.)
-    uint32_t num_frames = data.size() * 16 / 9;
+  private:
+    const AifcEntry &entry;
+    ThreadPool &pool;
+    const RoundtripBudget &budget;
+    const ArtifactCache &cache;
+    vector<pair<size_t, RoundtripResult>> &fallbacks;
+    bool decoded = false, exact = true;
+    AiffImage aiff;
+
+    static vector<byte> sample_rate(const vector<double> &tunings);
+};
 
+// COMM sample rate as an 80-bit float, from the tunings of every sound that plays the sample
+vector<byte> AiffWriter::sample_rate(const vector<double> &tunings) {
     double sample_rate;
-    if (entry.tunings.size() == 1) {
-        sample_rate = 32000 * entry.tunings[0];
+    if (tunings.size() == 1) {
+        sample_rate = 32000 * tunings[0];
     } else {
-        double min_tuning = *min_element(entry.tunings.begin(), entry.tunings.end());
-        double max_tuning = *max_element(entry.tunings.begin(), entry.tunings.end());
+        double min_tuning = *min_element(tunings.begin(), tunings.end());
+        double max_tuning = *max_element(tunings.begin(), tunings.end());
         if (min_tuning <= 0.5 && max_tuning >= 0.5) {
             sample_rate = 16000;
         } else if (min_tuning <= 1.0 && max_tuning >= 1.0) {
@@ -1499,62 +3108,154 @@ void AiffWriter::write(const AifcEntry &entry) {
         }
     }
 
-    vector<byte> comm_section(18);
-    auto sample_rate_bytes = serialize_f80(sample_rate);
-    WRITE_16_BITS(num_channels, comm_section, 0);
-    WRITE_32_BITS(num_frames, comm_section, 2);
-    WRITE_16_BITS(sample_size, comm_section, 6);
-    for (size_t i = 0; i < 10; i++) {
-        comm_section[i + 8] = sample_rate_bytes[i];
-    }
+    return serialize_f80(sample_rate);
+}
+
+// Everything that ends up in the file. The search budget is left out: only decodes that needed no
+// fallback search are cached or recorded, and those come out the same under any budget.
+CacheKey AiffWriter::key(const AifcEntry &entry, const AifcEntry::Name &name) {
+    CacheKey key;
+    key.add(as_bytes(span("aiff", 4)));
+    key.add_value(OUTPUT_VERSION);
+    key.add_value(entry.id);
+    key.add(sample_rate(name.tunings));
+    return key;
+}
 
-    string vapc_string = "VAPC", vadpcm_string = "VADPCM ~4-1";
-    vector<byte> vapc_data(vapc_string.size()), vadpcm_data = pstring(vadpcm_string);
-    transform(vapc_string.begin(), vapc_string.end(), vapc_data.begin(), INTO_BYTES);
-    comm_section.insert(comm_section.end(), vapc_data.begin(), vapc_data.end());
-    comm_section.insert(comm_section.end(), vadpcm_data.begin(), vadpcm_data.end());
-    add_section("COMM", comm_section);
+int AiffWriter::write(int fd, const AifcEntry::Name &name, const CacheKey &key) {
+    int ret = 0;
+    auto write_cached = [&](span<const byte> cached) {
+        iovec iov = { const_cast<byte *>(cached.data()), cached.size() };
+        ret = write_fully(fd, &iov, 1);
+    };
+    if (cache.load(key, write_cached)) {
+        return ret;
+    }
 
-    vector<byte> instrmt_section(20, static_cast<byte>('\0'));
-    add_section("INST", instrmt_section);
+    auto rate = sample_rate(name.tunings);
+    if (!decoded) {
+        assert(entry.data.size() % 9 == 0);
+        // vadpcm_enc would put data.size() * 16 / 9 frames in COMM after padding the data to an even
+        // length, which is one too many when the length is odd. aifc_decode.c dropped that frame
+        // again, so every sample decodes to exactly 16 frames per 9-byte block.
+        s32 num_frames = entry.data.size() / 9 * 16;
 
-    vector<byte> vadpcm_codes(6);
-    WRITE_16_BITS(1, vadpcm_codes, 0);
-    WRITE_16_BITS(entry.book.order, vadpcm_codes, 2);
-    WRITE_16_BITS(entry.book.npredictors, vadpcm_codes, 4);
-    for (int16_t value : entry.book.table) {
-        vadpcm_codes.push_back(static_cast<byte>((value >> 8) & 0xFF));
-        vadpcm_codes.push_back(static_cast<byte>(value & 0xFF));
+        size_t reported = fallbacks.size();
+        const ALADPCMLoop *loop = entry.loop.count != 0 ? &entry.loop : nullptr;
+        aiff = decode_vadpcm(entry.book.codebook, loop, entry.data, num_frames, rate, pool, budget,
+                             fallbacks);
+        decoded = true;
+        exact = fallbacks.size() == reported;
+    } else if (!aiff.empty()) {
+        aiff.set_sample_rate(rate);
     }
-    add_custom_section("VADPCMCODES", vadpcm_codes);
 
-    vector<byte> ssnd_section(8, static_cast<byte>(0));
-    ssnd_section.insert(ssnd_section.end(), data.begin(), data.end());
-    add_section("SSND", ssnd_section);
+    // decode_vadpcm() has already said why the sample couldn't be decoded
+    if (aiff.empty()) {
+        return EINVAL;
+    }
 
-    if (entry.loop.count != 0) {
-        vector<byte> vadpcm_loops(16);
-        WRITE_16_BITS(1, vadpcm_loops, 0);
-        WRITE_16_BITS(1, vadpcm_loops, 2);
-        WRITE_32_BITS(entry.loop.start, vadpcm_loops, 4);
-        WRITE_32_BITS(entry.loop.end, vadpcm_loops, 8);
-        WRITE_32_BITS(entry.loop.count, vadpcm_loops, 12);
-        for (int16_t value : entry.loop.state) {
-            vadpcm_loops.push_back(static_cast<byte>((value >> 8) & 0xFF));
-            vadpcm_loops.push_back(static_cast<byte>(value & 0xFF));
-        }
-        add_custom_section("VADPCMLOOPS", vadpcm_loops);
+    if (exact) {
+        cache.store(key, aiff.header, aiff.samples);
     }
 
-    finish();
+    return write_aiff_image(fd, aiff);
 }
 // End AiffWriter
 
 // estimate.c translated to C++
 
+// The routines below work on vectors and (order + 1)-square matrices, indexed from 1 like the C
+// original. With the order known at compile time they are std::arrays, so analysing a frame
+// allocates nothing and the loops have fixed trip counts. DYNAMIC_ORDER selects heap-allocated
+// ones sized from the `n`/`order` arguments instead, for any other order. Per-frame results are kept
+// in Rows, order + 1 doubles a frame back to back in one buffer either way, and handed around as Row.
+constexpr size_t DYNAMIC_ORDER = 0;
+
+template <size_t ORDER> struct Lpc {
+    using Vector = array<double, ORDER + 1>;
+    using Matrix = array<Vector, ORDER + 1>;
+    using Indices = array<int, ORDER + 1>;
+    using Rows = vector<Vector>;
+    using Row = Vector &;
+    using ConstRow = const Vector &;
+
+    static Vector make_vector([[maybe_unused]] const size_t order) {
+        assert(order == ORDER);
+        return {};
+    }
+    static Matrix make_matrix([[maybe_unused]] const size_t order) {
+        assert(order == ORDER);
+        return {};
+    }
+    static Indices make_indices([[maybe_unused]] const size_t order) {
+        assert(order == ORDER);
+        return {};
+    }
+    static Rows make_rows([[maybe_unused]] const size_t order) {
+        assert(order == ORDER);
+        return {};
+    }
+};
+
+// vector<Vector> for an order only known at run time: one allocation for all the frames, not one each
+class FlatRows {
+  public:
+    explicit FlatRows(const size_t order) : stride(order + 1) {
+    }
+
+    size_t size(void) const {
+        return values.size() / stride;
+    }
+    void clear(void) {
+        values.clear();
+    }
+    void resize(const size_t count) {
+        values.resize(count * stride);
+    }
+
+    span<double> operator[](const size_t i) {
+        return span(values).subspan(i * stride, stride);
+    }
+    span<const double> operator[](const size_t i) const {
+        return span(values).subspan(i * stride, stride);
+    }
+    span<double> back(void) {
+        return (*this)[size() - 1];
+    }
+
+  private:
+    size_t stride;
+    vector<double> values;
+};
+
+template <> struct Lpc<DYNAMIC_ORDER> {
+    using Vector = vector<double>;
+    using Matrix = vector<vector<double>>;
+    using Indices = vector<int>;
+    using Rows = FlatRows;
+    using Row = span<double>;
+    using ConstRow = span<const double>;
+
+    static Vector make_vector(const size_t order) {
+        return Vector(order + 1);
+    }
+    static Matrix make_matrix(const size_t order) {
+        return Matrix(order + 1, Vector(order + 1));
+    }
+    static Indices make_indices(const size_t order) {
+        return Indices(order + 1);
+    }
+    static Rows make_rows(const size_t order) {
+        return Rows(order);
+    }
+};
+
 // https://en.wikipedia.org/wiki/Durbin%E2%80%93Watson_statistic ?
 // "detects the presence of autocorrelation at lag 1 in the residuals (prediction errors)"
-int durbin(const vector<double> &arg0, const int n, vector<double> &arg2, vector<double> &arg3) {
+template <size_t ORDER>
+int durbin(const typename Lpc<ORDER>::Vector &arg0, const int n, typename Lpc<ORDER>::Vector &arg2,
+           typename Lpc<ORDER>::Vector &arg3) {
     int i, j;
     double sum, div;
     int ret;
@@ -1586,7 +3287,8 @@ int durbin(const vector<double> &arg0, const int n, vector<double> &arg2, vector
     return ret;
 }
 
-void afromk(const vector<double> &in, vector<double> &out, const size_t n) {
+template <size_t ORDER>
+void afromk(const typename Lpc<ORDER>::Vector &in, typename Lpc<ORDER>::Row out, const size_t n) {
     out[0] = 1.0f;
     for (size_t i = 1; i <= n; i++) {
         out[i] = in[i];
@@ -1596,14 +3298,14 @@ void afromk(const vector<double> &in, vector<double> &out, const size_t n) {
     }
 }
 
-int kfroma(vector<double> &in, vector<double> &out, const size_t n) {
+template <size_t ORDER>
+int kfroma(typename Lpc<ORDER>::Vector &in, typename Lpc<ORDER>::Vector &out, const size_t n) {
     double div;
     double temp;
-    vector<double> next;
+    auto next = Lpc<ORDER>::make_vector(n);
     int ret;
 
     ret = 0;
-    next.resize(n + 1);
 
     out[n] = in[n];
     for (size_t i = n - 1; i >= 1; i--) {
@@ -1629,19 +3331,19 @@ int kfroma(vector<double> &in, vector<double> &out, const size_t n) {
     return ret;
 }
 
-void rfroma(const vector<double> &arg0, const size_t n, vector<double> &arg2) {
-    vector<vector<double>> mat;
+// Row i - 1 of `mat` only uses its first i entries
+// `mat` is scratch space, made by Lpc<ORDER>::make_matrix(n)
+template <size_t ORDER>
+void rfroma(typename Lpc<ORDER>::ConstRow arg0, const size_t n, typename Lpc<ORDER>::Row arg2,
+            typename Lpc<ORDER>::Matrix &mat) {
     double div;
 
-    mat.resize(n + 1);
-    mat[n].resize(n + 1);
     mat[n][0] = 1.0;
     for (size_t i = 1; i <= n; i++) {
         mat[n][i] = -arg0[i];
     }
 
     for (size_t i = n; i >= 1; i--) {
-        mat[i - 1].resize(i);
         div = 1.0 - mat[i][i] * mat[i][i];
         for (size_t j = 1; j <= i - 1; j++) {
             mat[i - 1][j] = (mat[i][i - j] * mat[i][i] + mat[i][j]) / div;
@@ -1657,47 +3359,28 @@ void rfroma(const vector<double> &arg0, const size_t n, vector<double> &arg2) {
     }
 }
 
-double model_dist(const vector<double> &arg0, const vector<double> &arg1, const size_t n) {
-    vector<double> sp3C, sp38;
-    double ret;
-
-    sp3C.resize(n + 1);
-    sp38.resize(n + 1);
-    rfroma(arg1, n, sp3C);
-
-    for (size_t i = 0; i <= n; i++) {
-        sp38[i] = 0.0;
-        for (size_t j = 0; j <= n - i; j++) {
-            sp38[i] += arg0[j] * arg0[i + j];
-        }
-    }
-
-    ret = sp38[0] * sp3C[0];
-    for (size_t i = 1; i <= n; i++) {
-        ret += 2 * sp3C[i] * sp38[i];
-    }
-
-    return ret;
-}
-
 // compute autocorrelation matrix?
-void acmat(const vector<short> &in, const size_t n, const size_t m, vector<vector<double>> &out) {
+// (like acvect(), this reads the n samples before `in` as well)
+template <size_t ORDER>
+void acmat(const short *in, const size_t n, const size_t m, typename Lpc<ORDER>::Matrix &out) {
     for (size_t i = 1; i <= n; i++) {
         for (size_t j = 1; j <= n; j++) {
             out[i][j] = 0.0f;
             for (size_t k = 0; k < m; k++) {
-                out[i][j] += in[k - i] * in[k - j];
+                out[i][j] += (in - i)[k] * (in - j)[k];
             }
         }
     }
 }
 
 // compute autocorrelation vector?
-void acvect(const vector<short> &in, const size_t n, const size_t m, vector<double> &out) {
+// `in` is a window of m samples inside a larger buffer; the n samples before it are read as history
+template <size_t ORDER>
+void acvect(const short *in, const size_t n, const size_t m, typename Lpc<ORDER>::Vector &out) {
     for (size_t i = 0; i <= n; i++) {
         out[i] = 0.0f;
         for (size_t j = 0; j < m; j++) {
-            out[i] -= in[j - i] * in[j];
+            out[i] -= (in - i)[j] * in[j];
         }
     }
 }
@@ -1722,12 +3405,12 @@ void acvect(const vector<short> &in, const size_t n, const size_t m, vector<doub
  * Derived from ludcmp in "Numerical Recipes in C: The Art of Scientific Computing",
  * with modified error handling.
  */
-int lud(vector<vector<double>> &a, const size_t n, vector<int> &indx, int *d) {
+template <size_t ORDER>
+int lud(typename Lpc<ORDER>::Matrix &a, const size_t n, typename Lpc<ORDER>::Indices &indx, int *d) {
     size_t imax;
     double big, dum, sum, temp, min, max;
-    vector<double> vv;
+    auto vv = Lpc<ORDER>::make_vector(n);
 
-    vv.resize(n + 1);
     *d = 1;
     for (size_t i = 1; i <= n; i++) {
         big = 0.0;
@@ -1812,7 +3495,9 @@ int lud(vector<vector<double>> &a, const size_t n, vector<int> &indx, int *d) {
  *
  * From "Numerical Recipes in C: The Art of Scientific Computing".
  */
-void lubksb(vector<vector<double>> &a, const int n, vector<int> &indx, vector<double> &b) {
+template <size_t ORDER>
+void lubksb(const typename Lpc<ORDER>::Matrix &a, const int n, const typename Lpc<ORDER>::Indices &indx,
+            typename Lpc<ORDER>::Vector &b) {
     int i, ii = 0, ip, j;
     double sum;
 
@@ -1838,8 +3523,9 @@ void lubksb(vector<vector<double>> &a, const int n, vector<int> &indx, vector<do
 // End translated estimate.c
 
 // codebook.c translated to C++
-void split(vector<vector<double>> &table, const vector<double> &delta, const size_t order,
-           const size_t npredictors, const double scale) {
+template <size_t ORDER>
+void split(vector<typename Lpc<ORDER>::Vector> &table, const typename Lpc<ORDER>::Vector &delta,
+           const size_t order, const size_t npredictors, const double scale) {
     for (size_t i = 0; i < npredictors; i++) {
         for (size_t j = 0; j <= order; j++) {
             table[i + npredictors][j] = table[i][j] + delta[j] * scale;
@@ -1847,21 +3533,25 @@ void split(vector<vector<double>> &table, const vector<double> &delta, const siz
     }
 }
 
-void refine(vector<vector<double>> &table, const size_t order, const size_t npredictors,
-            const vector<vector<double>> &data, const size_t dataSize, const size_t refineIters) {
-    vector<vector<double>> rsums;
+// `frames(visit)` hands rfroma() of every analysed frame to `visit`, a block at a time and always in
+// the same order. Frames are assigned to their nearest predictor in parallel and summed up in frame
+// order afterwards, so the table doesn't depend on how the frames were split between threads or
+// into blocks. A pass that leaves every predictor as it was ends the refinement early: the passes
+// after it would assign the frames the same way and come to the same table again.
+template <size_t ORDER, class Frames>
+void refine(vector<typename Lpc<ORDER>::Vector> &table, const size_t order, const size_t npredictors,
+            const Frames &frames, const size_t refineIters, ThreadPool &pool) {
+    const size_t chunkSize = 4096;
+    vector<typename Lpc<ORDER>::Vector> rsums(npredictors, Lpc<ORDER>::make_vector(order));
     vector<int> counts; // spD0
-    vector<double> temp_s7;
-    double dist, bestValue;
-    size_t bestIndex;
-
-    rsums.resize(npredictors);
-    for (auto &rsums_element : rsums) {
-        rsums_element.resize(order + 1);
-    }
+    auto temp_s7 = Lpc<ORDER>::make_vector(order);
+    vector<typename Lpc<ORDER>::Vector> previous;
+    vector<double> autocorr, dists;
+    vector<size_t> nearest;
 
     counts.resize(npredictors);
-    temp_s7.resize(order + 1);
+    // lag-major, so that each frame's distances to all predictors are computed side by side
+    autocorr.resize((order + 1) * npredictors);
 
     for (size_t iter = 0; iter < refineIters; iter++) {
         for (size_t i = 0; i < npredictors; i++) {
@@ -1871,24 +3561,56 @@ void refine(vector<vector<double>> &table, const size_t order, const size_t npre
             }
         }
 
-        for (size_t i = 0; i < dataSize; i++) {
-            bestValue = 1e30;
-            bestIndex = 0;
-
-            for (size_t j = 0; j < npredictors; j++) {
-                dist = model_dist(table[j], data[i], order);
-                if (dist < bestValue) {
-                    bestValue = dist;
-                    bestIndex = j;
+        // model_dist() from codebook.c is the dot product of a frame's rfroma() with its predictor's
+        // autocorrelation, which only has to be worked out once per predictor
+        for (size_t j = 0; j < npredictors; j++) {
+            for (size_t i = 0; i <= order; i++) {
+                double sum = 0.0;
+                for (size_t k = 0; k <= order - i; k++) {
+                    sum += table[j][k] * table[j][i + k];
                 }
+                autocorr[i * npredictors + j] = sum;
             }
+        }
 
-            counts[bestIndex]++;
-            rfroma(data[i], order, temp_s7);
-            for (size_t j = 0; j <= order; j++) {
-                rsums[bestIndex][j] += temp_s7[j];
+        frames([&](const typename Lpc<ORDER>::Rows &rdata) {
+            size_t chunks = (rdata.size() + chunkSize - 1) / chunkSize;
+            dists.resize(max(dists.size(), chunks * npredictors));
+            nearest.resize(max(nearest.size(), rdata.size()));
+
+            pool.parallel_for(chunks, [&](size_t chunk) {
+                double *dist = dists.data() + chunk * npredictors;
+                size_t end = min(rdata.size(), (chunk + 1) * chunkSize);
+                for (size_t i = chunk * chunkSize; i < end; i++) {
+                    const auto &r = rdata[i];
+                    for (size_t j = 0; j < npredictors; j++) {
+                        dist[j] = autocorr[j] * r[0];
+                    }
+                    for (size_t k = 1; k <= order; k++) {
+                        for (size_t j = 0; j < npredictors; j++) {
+                            dist[j] += 2 * r[k] * autocorr[k * npredictors + j];
+                        }
+                    }
+
+                    double bestValue = 1e30;
+                    size_t bestIndex = 0;
+                    for (size_t j = 0; j < npredictors; j++) {
+                        if (dist[j] < bestValue) {
+                            bestValue = dist[j];
+                            bestIndex = j;
+                        }
+                    }
+                    nearest[i] = bestIndex;
+                }
+            });
+
+            for (size_t i = 0; i < rdata.size(); i++) {
+                counts[nearest[i]]++;
+                for (size_t j = 0; j <= order; j++) {
+                    rsums[nearest[i]][j] += rdata[i][j];
+                }
             }
-        }
+        });
 
         for (size_t i = 0; i < npredictors; i++) {
             if (counts[i] > 0) {
@@ -1898,8 +3620,9 @@ void refine(vector<vector<double>> &table, const size_t order, const size_t npre
             }
         }
 
+        previous.assign(table.begin(), table.begin() + npredictors);
         for (size_t i = 0; i < npredictors; i++) {
-            durbin(rsums[i], order, temp_s7, table[i]);
+            durbin<ORDER>(rsums[i], order, temp_s7, table[i]);
 
             for (size_t j = 1; j <= order; j++) {
                 if (temp_s7[j] >= 1.0) {
@@ -1910,14 +3633,19 @@ void refine(vector<vector<double>> &table, const size_t order, const size_t npre
                 }
             }
 
-            afromk(temp_s7, table[i], order);
+            afromk<ORDER>(temp_s7, table[i], order);
+        }
+
+        if (equal(previous.begin(), previous.end(), table.begin())) {
+            break;
         }
     }
 }
 // End translated codebook.c
 
 // print.c translated to C++
-int write_tabledesign_codebook_entry(ofstream &out, vector<double> &row, const size_t order) {
+template <class Row>
+int write_tabledesign_codebook_entry(ostream &out, const Row &row, const size_t order) {
     vector<vector<double>> table;
     double fval;
     int ival, overflows;
@@ -1969,137 +3697,290 @@ int write_tabledesign_codebook_entry(ofstream &out, vector<double> &row, const s
                     overflows++;
                 }
             }
-            out << setw(5) << ival << " ";
+            out << setw(5) << ival << " ";
+        }
+        out << endl;
+    }
+
+    return overflows;
+}
+// End translated print.c
+
+// tabledesign.c translated to C++
+
+// How tables for the extended soundbank .aiff files are designed
+struct TableDesignParams {
+    // Prediction order, and the table gets 1 << bits predictors, each refined refineIters times
+    size_t order = 2;
+    size_t bits = 1;
+    size_t refineIters = 2;
+    // Analyse the frames again on every pass instead of keeping them, for samples too long to hold
+    bool streaming = false;
+};
+
+// Stands in for the libaudiofile calls tabledesign.c made: the sample data of a mono 16-bit AIFF file,
+// or of an AIFF-C file stored uncompressed (NONE/twos big-endian or sowt little-endian), read
+// straight out of the mapped file as open_aiff_pcm() found it.
+struct AiffPcm {
+    span<const byte> sound;
+    size_t count = 0;
+    bool littleEndian = false;
+
+    // Samples [first, first + n) in native byte order. Those before the start come out as zeros, so
+    // the first frame's analysis can look back just like any other's.
+    void read(ptrdiff_t first, size_t n, short *out) const {
+        for (size_t i = 0; i < n; i++, first++) {
+            if (first < 0) {
+                out[i] = 0;
+            } else if (littleEndian) {
+                out[i] = static_cast<short>((static_cast<uint8_t>(sound[2 * first + 1]) << 8)
+                                            | static_cast<uint8_t>(sound[2 * first]));
+            } else {
+                out[i] = static_cast<short>(READ_16_BITS(sound, 2 * first));
+            }
+        }
+    }
+};
+
+int open_aiff_pcm(const string &filename, const MappedFile &file, AiffPcm &pcm) {
+    if (!file) {
+        cerr << "open_aiff_pcm(): input AIFF file " << filename << " could not be opened." << endl;
+        return 1;
+    }
+
+    auto data = file.bytes();
+    if (data.size() < 12 || memcmp(data.data(), "FORM", 4) != 0
+        || (memcmp(data.data() + 8, "AIFF", 4) != 0 && memcmp(data.data() + 8, "AIFC", 4) != 0)) {
+        cerr << "open_aiff_pcm(): file " << filename << " is not an AIFF file." << endl;
+        return 1;
+    }
+    bool aifc = memcmp(data.data() + 8, "AIFC", 4) == 0, littleEndian = false, haveComm = false;
+    int channels = 0, sampleWidth = 0;
+    size_t frameCount = 0;
+    span<const byte> sound;
+
+    for (size_t pos = 12; pos + 8 <= data.size();) {
+        const byte *id = data.data() + pos;
+        size_t body = pos + 8, size = min<size_t>(static_cast<uint32_t>(READ_32_BITS(data, pos + 4)),
+                                                  data.size() - body);
+        if (memcmp(id, "COMM", 4) == 0 && size >= 18) {
+            haveComm = true;
+            channels = static_cast<int16_t>(READ_16_BITS(data, body));
+            frameCount = static_cast<uint32_t>(READ_32_BITS(data, body + 2));
+            sampleWidth = static_cast<int16_t>(READ_16_BITS(data, body + 6));
+            if (aifc && size >= 22) {
+                const byte *compression = data.data() + body + 18;
+                littleEndian = memcmp(compression, "sowt", 4) == 0;
+                if (!littleEndian && memcmp(compression, "NONE", 4) != 0
+                    && memcmp(compression, "twos", 4) != 0) {
+                    cerr << "open_aiff_pcm(): file " << filename << " is compressed, only uncompressed "
+                         << "sample data supported." << endl;
+                    return 3;
+                }
+            }
+        } else if (memcmp(id, "SSND", 4) == 0 && size >= 8) {
+            size_t offset = static_cast<uint32_t>(READ_32_BITS(data, body));
+            if (offset <= size - 8) {
+                sound = data.subspan(body + 8 + offset, size - 8 - offset);
+            }
         }
-        out << endl;
+        pos = body + ((size + 1) & ~static_cast<size_t>(1));
     }
 
-    return overflows;
-}
-// End translated print.c
-
-// tabledesign.c translated to C++ (except for calls to external C library audiofile)
-int write_tabledesign_codebook(const string &filename, ofstream &out) {
-    double thresh;
-    vector<short> temp_s3;
-    vector<int> perm;
-    vector<double> spF4, vec, splitDelta;
-    vector<vector<double>> mat, temp_s1, data;
-    size_t order, bits, refineIters, frameSize, npredictors, numOverflows, dataSize;
-    int permDet, sampleFormat, sampleWidth, channels, tracks;
-
-    AFframecount frameCount;
-    AFfilehandle afFile;
-
-    order = 2;
-    bits = 1;
-    refineIters = 2;
-    frameSize = 16;
-    numOverflows = 0;
-    thresh = 10.0;
-
-    afFile = afOpenFile(filename.c_str(), "rb", nullptr);
-    if (afFile == nullptr) {
-        cerr << "write_tabledesign_codebook(): input AIFC file " << filename << " could not be opened."
-             << endl;
+    if (!haveComm) {
+        cerr << "open_aiff_pcm(): file " << filename << " has no COMM chunk." << endl;
         return 1;
     }
 
-    channels = afGetChannels(afFile, AF_DEFAULT_TRACK);
     if (channels != 1) {
-        cerr << "write_tabledesign_codebook(): file " << filename << " contains " << channels
+        cerr << "open_aiff_pcm(): file " << filename << " contains " << channels
              << " channels, only 1 channel supported." << endl;
         return 2;
     }
 
-    tracks = afGetTrackIDs(afFile, nullptr);
-    if (tracks != 1) {
-        cerr << "write_tabledesign_codebook(): file " << filename << " contains " << tracks
-             << " tracks, only 1 track supported." << endl;
-        return 3;
-    }
-
-    afGetSampleFormat(afFile, AF_DEFAULT_TRACK, &sampleFormat, &sampleWidth);
     if (sampleWidth != 16) {
-        cerr << "write_tabledesign_codebook(): file " << filename << " contains " << sampleWidth
+        cerr << "open_aiff_pcm(): file " << filename << " contains " << sampleWidth
              << " bit samples, only 16 bit samples supported." << endl;
         return 4;
     }
 
-    temp_s1.resize(1 << bits);
-    for (auto &temp_s1_element : temp_s1) {
-        temp_s1_element.resize(order + 1);
-    }
+    pcm.count = min(frameCount, sound.size() / 2);
+    pcm.sound = sound.first(pcm.count * 2);
+    pcm.littleEndian = littleEndian;
+
+    return 0;
+}
+
+// The frame analysis of tabledesign.c over a range of frames, reading the samples a block at a time.
+// Every frame that passes gets rfroma() of its model appended to `rdata`, which is all that the
+// clustering needs from it; the models themselves only live as long as their block, in a buffer that
+// is reused from one block to the next.
+template <size_t ORDER> class FrameAnalysis {
+  public:
+    using Vector = typename Lpc<ORDER>::Vector;
+    using Rows = typename Lpc<ORDER>::Rows;
+
+    // frames read and analysed at a time
+    static constexpr size_t BLOCK = 4096;
 
-    splitDelta.resize(order + 1);
-    temp_s3.resize(frameSize * 2);
-    for (auto &temp_s3_element : temp_s3) {
-        temp_s3_element = 0;
+    FrameAnalysis(const AiffPcm &pcm, const size_t order, const size_t frameSize, const double thresh,
+                  ThreadPool &pool)
+        : pcm(pcm), order(order), frameSize(frameSize), thresh(thresh), pool(pool),
+          window(order + BLOCK * frameSize), models(Lpc<ORDER>::make_rows(order)),
+          perm(Lpc<ORDER>::make_indices(order)),
+          spF4(Lpc<ORDER>::make_vector(order)), vec(Lpc<ORDER>::make_vector(order)),
+          mat(Lpc<ORDER>::make_matrix(order)) {
     }
 
-    vec.resize(order + 1);
-    spF4.resize(order + 1);
-    mat.resize(order + 1);
-    for (auto &mat_element : mat) {
-        mat_element.resize(order + 1);
+    // A trailing partial frame is left out of the analysis
+    size_t frames(void) const {
+        return pcm.count / frameSize;
     }
 
-    perm.resize(order + 1);
-    frameCount = afGetFrameCount(afFile, AF_DEFAULT_TRACK);
-    afGetRate(afFile, AF_DEFAULT_TRACK);
-    data.resize(frameCount);
+    void analyse(size_t first, size_t count, Rows &rdata);
 
-    dataSize = 0;
-    while (afReadFrames(afFile, AF_DEFAULT_TRACK, temp_s3.data() + frameSize, frameSize)
-           == static_cast<int>(frameSize)) {
-        const auto temp_s3_body = vector<short>(temp_s3.begin() + frameSize, temp_s3.end());
-        acvect(temp_s3_body, order, frameSize, vec);
-        if (fabs(vec[0]) > thresh) {
-            acmat(temp_s3_body, order, frameSize, mat);
-            if (lud(mat, order, perm, &permDet) == 0) {
-                lubksb(mat, order, perm, vec);
-                vec[0] = 1.0;
-                if (kfroma(vec, spF4, order) == 0) {
-                    data[dataSize].resize(order + 1);
-                    data[dataSize][0] = 1.0;
-
-                    for (size_t i = 1; i <= order; i++) {
-                        if (spF4[i] >= 1.0) {
-                            spF4[i] = 0.9999999999;
-                        }
-                        if (spF4[i] <= -1.0) {
-                            spF4[i] = -0.9999999999;
+  private:
+    // Order 2 takes its autocorrelations from the kernels, LAG_BLOCK frames at a time. They are the
+    // sums acvect() and acmat() come to, which are exact integers in doubles.
+    static constexpr size_t LAG_BLOCK = 256;
+    // frames a parallel_for() index turns into rdata, with one scratch matrix between them
+    static constexpr size_t RFROMA_CHUNK = 256;
+
+    const AiffPcm &pcm;
+    const size_t order, frameSize;
+    const double thresh;
+    ThreadPool &pool;
+    vector<short> window;
+    Rows models;
+    typename Lpc<ORDER>::Indices perm;
+    Vector spF4, vec;
+    typename Lpc<ORDER>::Matrix mat;
+    s64 lags[LAG_BLOCK][6];
+};
+
+template <size_t ORDER>
+void FrameAnalysis<ORDER>::analyse(size_t first, size_t count, Rows &rdata) {
+    int permDet;
+
+    for (size_t block = first; block < first + count; block += BLOCK) {
+        size_t blockFrames = min(BLOCK, first + count - block);
+        // each frame looks back `order` samples, into zeros for the first one
+        pcm.read(static_cast<ptrdiff_t>(block * frameSize) - static_cast<ptrdiff_t>(order),
+                 order + blockFrames * frameSize, window.data());
+
+        models.clear();
+        for (size_t frame = 0; frame < blockFrames; frame++) {
+            const short *in = window.data() + order + frame * frameSize;
+            const s64 *sums = lags[frame % LAG_BLOCK];
+            if constexpr (ORDER == 2) {
+                if (frame % LAG_BLOCK == 0) {
+                    adpcm_kernels->for_order(2).frame_lags(in, min(LAG_BLOCK, blockFrames - frame),
+                                                           frameSize, lags);
+                }
+                // acvect() subtracts the products
+                for (size_t i = 0; i <= 2; i++) {
+                    vec[i] = static_cast<double>(-sums[i]);
+                }
+            } else {
+                acvect<ORDER>(in, order, frameSize, vec);
+            }
+            if (fabs(vec[0]) > thresh) {
+                if constexpr (ORDER == 2) {
+                    mat[1][1] = static_cast<double>(sums[3]);
+                    mat[1][2] = mat[2][1] = static_cast<double>(sums[4]);
+                    mat[2][2] = static_cast<double>(sums[5]);
+                } else {
+                    acmat<ORDER>(in, order, frameSize, mat);
+                }
+                if (lud<ORDER>(mat, order, perm, &permDet) == 0) {
+                    lubksb<ORDER>(mat, order, perm, vec);
+                    vec[0] = 1.0;
+                    if (kfroma<ORDER>(vec, spF4, order) == 0) {
+                        models.resize(models.size() + 1);
+                        models.back()[0] = 1.0;
+
+                        for (size_t i = 1; i <= order; i++) {
+                            if (spF4[i] >= 1.0) {
+                                spF4[i] = 0.9999999999;
+                            }
+                            if (spF4[i] <= -1.0) {
+                                spF4[i] = -0.9999999999;
+                            }
                         }
-                    }
 
-                    afromk(spF4, data[dataSize], order);
-                    dataSize++;
+                        afromk<ORDER>(spF4, models.back(), order);
+                    }
                 }
             }
         }
 
-        for (size_t i = 0; i < frameSize; i++) {
-            temp_s3[i] = temp_s3[i + frameSize];
-        }
+        size_t base = rdata.size(), chunks = (models.size() + RFROMA_CHUNK - 1) / RFROMA_CHUNK;
+        rdata.resize(base + models.size());
+        pool.parallel_for(chunks, [&](size_t chunk) {
+            auto scratch = Lpc<ORDER>::make_matrix(order);
+            size_t end = min(models.size(), (chunk + 1) * RFROMA_CHUNK);
+            for (size_t i = chunk * RFROMA_CHUNK; i < end; i++) {
+                rfroma<ORDER>(models[i], order, rdata[base + i], scratch);
+            }
+        });
     }
+}
+
+// The predictor clustering of tabledesign.c for prediction order ORDER, or for `order` when ORDER is
+// DYNAMIC_ORDER. Returns the 1 << bits predictors. Normally rfroma() of every frame is kept for all
+// the passes over them, order + 1 contiguous doubles per frame; with `streaming` the
+// frames are analysed again for each pass instead, so memory stays at a block's worth however long
+// the sample is.
+template <size_t ORDER>
+vector<typename Lpc<ORDER>::Vector> design_predictors(const AiffPcm &pcm, const size_t order,
+                                                      const size_t bits, const size_t refineIters,
+                                                      const size_t frameSize, const double thresh,
+                                                      const bool streaming, ThreadPool &pool) {
+    using Vector = typename Lpc<ORDER>::Vector;
+    using Rows = typename Lpc<ORDER>::Rows;
+    auto analysis = FrameAnalysis<ORDER>(pcm, order, frameSize, thresh, pool);
+    auto spF4 = Lpc<ORDER>::make_vector(order), vec = Lpc<ORDER>::make_vector(order),
+         splitDelta = Lpc<ORDER>::make_vector(order);
+    vector<Vector> temp_s1(1 << bits, Lpc<ORDER>::make_vector(order));
+    Rows rdata = Lpc<ORDER>::make_rows(order);
+    size_t dataSize;
+
+    if (!streaming) {
+        analysis.analyse(0, analysis.frames(), rdata);
+    }
+    auto frames = [&](auto &&visit) {
+        if (!streaming) {
+            visit(rdata);
+            return;
+        }
+        const size_t block = FrameAnalysis<ORDER>::BLOCK;
+        for (size_t first = 0; first < analysis.frames(); first += block) {
+            rdata.clear();
+            analysis.analyse(first, min(block, analysis.frames() - first), rdata);
+            visit(rdata);
+        }
+    };
 
     vec[0] = 1.0;
     for (size_t j = 1; j <= order; j++) {
         vec[j] = 0.0;
     }
 
-    for (size_t i = 0; i < dataSize; i++) {
-        rfroma(data[i], order, temp_s1[0]);
-        for (size_t j = 1; j <= order; j++) {
-            vec[j] += temp_s1[0][j];
+    dataSize = 0;
+    frames([&](const Rows &block) {
+        for (size_t i = 0; i < block.size(); i++) {
+            for (size_t j = 1; j <= order; j++) {
+                vec[j] += block[i][j];
+            }
         }
-    }
+        dataSize += block.size();
+    });
 
     for (size_t j = 1; j <= order; j++) {
         vec[j] /= dataSize;
     }
 
-    durbin(vec, order, spF4, temp_s1[0]);
+    durbin<ORDER>(vec, order, spF4, temp_s1[0]);
 
     for (size_t j = 1; j <= order; j++) {
         if (spF4[j] >= 1.0) {
@@ -2110,28 +3991,86 @@ int write_tabledesign_codebook(const string &filename, ofstream &out) {
         }
     }
 
-    afromk(spF4, temp_s1[0], order);
+    afromk<ORDER>(spF4, temp_s1[0], order);
     for (size_t curBits = 0; curBits < bits; curBits++) {
         for (size_t i = 0; i <= order; i++) {
             splitDelta[i] = 0.0;
         }
         splitDelta[order - 1] = -1.0;
-        split(temp_s1, splitDelta, order, 1 << curBits, 0.01);
-        refine(temp_s1, order, 1 << (curBits + 1), data, dataSize, refineIters);
+        split<ORDER>(temp_s1, splitDelta, order, 1 << curBits, 0.01);
+        refine<ORDER>(temp_s1, order, 1 << (curBits + 1), frames, refineIters, pool);
+    }
+
+    return temp_s1;
+}
+
+int write_tabledesign_codebook(const string &filename, ofstream &file, const ArtifactCache &cache,
+                               const TableDesignParams &params, ThreadPool &pool) {
+    double thresh;
+    AiffPcm pcm;
+    size_t order, bits, refineIters, frameSize, npredictors, numOverflows;
+
+    order = params.order;
+    bits = params.bits;
+    refineIters = params.refineIters;
+    frameSize = 16;
+    numOverflows = 0;
+    thresh = 10.0;
+
+    auto aiffFile = MappedFile(filename);
+    int ret = open_aiff_pcm(filename, aiffFile, pcm);
+    if (ret) {
+        return ret;
     }
 
+    // The table only depends on the samples and the design parameters
+    CacheKey key;
+    key.add(as_bytes(span("table", 5)));
+    key.add_value(OUTPUT_VERSION);
+    for (size_t param : { order, bits, refineIters, frameSize }) {
+        key.add_value(param);
+    }
+    key.add_value(thresh);
+    key.add_value(pcm.littleEndian);
+    key.add(pcm.sound);
+
+    auto write_cached = [&](span<const byte> cached) {
+        file.write(reinterpret_cast<const char *>(cached.data()), cached.size());
+    };
+    if (cache.load(key, write_cached)) {
+        file.close();
+        return 0;
+    }
+
+    ostringstream out;
+
     npredictors = 1 << bits;
     out << order << endl << npredictors << endl;
 
-    for (size_t i = 0; i < npredictors; i++) {
-        numOverflows += write_tabledesign_codebook_entry(out, temp_s1[i], order);
+    auto write_entries = [&](const auto &predictors) {
+        for (size_t i = 0; i < npredictors; i++) {
+            numOverflows += write_tabledesign_codebook_entry(out, predictors[i], order);
+        }
+    };
+    // the order every sample in this game is designed with gets a fixed-size instantiation
+    if (order == 2) {
+        write_entries(design_predictors<2>(pcm, order, bits, refineIters, frameSize, thresh,
+                                           params.streaming, pool));
+    } else {
+        write_entries(design_predictors<DYNAMIC_ORDER>(pcm, order, bits, refineIters, frameSize, thresh,
+                                                       params.streaming, pool));
     }
 
+    // Tables that overflowed aren't cached, so the warning comes up on every run
+    string table = out.str();
     if (numOverflows > 0) {
         cerr << "There was overflow - check the table" << endl;
+    } else {
+        cache.store(key, as_bytes(span(table)));
     }
 
-    out.close();
+    file << table;
+    file.close();
 
     return 0;
 }
@@ -2141,10 +4080,22 @@ int write_tabledesign_codebook(const string &filename, ofstream &out) {
 /**
  * Create an ADPCM codebook by extracting it from an AIFF section
  */
-int write_codebook(const vector<byte> &aiffData, ofstream &out) {
+void write_codebook_table(const Codebook &book, ostream &out) {
+    out << book.order << endl << book.npredictors << endl;
+    for (s32 i = 0; i < book.npredictors; i++) {
+        for (s32 j = 0; j < book.order; j++) {
+            for (s32 k = 0; k < 8; k++) {
+                out << setw(5) << book.row(i, k)[j] << " ";
+            }
+            out << endl;
+        }
+    }
+}
+
+int write_codebook(span<const byte> aiffData, ofstream &out) {
     s16 order = -1;
     s16 npredictors = -1;
-    vector<vector<vector<s32>>> coefTable;
+    Codebook book;
     size_t inputBufferPosition = 0;
 
     char buf[5] = { 0 };
@@ -2182,7 +4133,7 @@ int write_codebook(const vector<byte> &aiffData, ofstream &out) {
                         read_bytes_from_vec(&version, sizeof(s16), 1, aiffData, &inputBufferPosition);
                         BSWAP16(version);
                         if (version == 1) {
-                            read_aifc_codebook(aiffData, &inputBufferPosition, coefTable, &order,
+                            read_aifc_codebook(aiffData, &inputBufferPosition, book, &order,
                                                &npredictors);
                         }
                     }
@@ -2193,21 +4144,12 @@ int write_codebook(const vector<byte> &aiffData, ofstream &out) {
         inputBufferPosition = nextOffset;
     }
 
-    if (!coefTable.size()) {
+    if (book.empty()) {
         // need to call write_tabledesign_codebook()
         return 3;
     }
 
-    out << order << endl << npredictors << endl;
-    for (s32 i = 0; i < npredictors; i++) {
-        for (s32 j = 0; j < order; j++) {
-            for (s32 k = 0; k < 8; k++) {
-                out << setw(5) << coefTable[i][k][j] << " ";
-            }
-            out << endl;
-        }
-    }
-
+    write_codebook_table(book, out);
     out.close();
 
     return 0;
@@ -2217,7 +4159,7 @@ int write_codebook(const vector<byte> &aiffData, ofstream &out) {
 // End classes
 
 // Main Routines
-vector<pair<uint32_t, uint32_t>> parse_seqfile(const vector<byte> &data, const uint16_t filetype) {
+vector<pair<uint32_t, uint32_t>> parse_seqfile(span<const byte> data, const uint16_t filetype) {
 
     uint16_t magic = READ_16_BITS(data, 0);
     uint16_t num_entries = READ_16_BITS(data, 2);
@@ -2244,7 +4186,7 @@ vector<pair<uint32_t, uint32_t>> parse_seqfile(const vector<byte> &data, const u
     return entries;
 }
 
-vector<SampleBank> parse_tbl(const vector<byte> &data,
+vector<SampleBank> parse_tbl(span<const byte> data,
                              const vector<pair<uint32_t, uint32_t>> &tbl_entries) {
     vector<SampleBank> banks;
     map<uint32_t, uint32_t> bank_address_to_index;
@@ -2255,100 +4197,240 @@ vector<SampleBank> parse_tbl(const vector<byte> &data,
     // SampleBank object
     for (size_t tbl_index = 0; tbl_index < tbl_entries.size(); tbl_index++) {
         uint32_t bank_address = tbl_entries[tbl_index].first, bank_size = tbl_entries[tbl_index].second;
-        if (!bank_address_to_index.count(bank_address)) {
-            auto bank = SampleBank(bank_index, vector<byte>(data.begin() + bank_address,
-                                                            data.begin() + bank_address + bank_size));
-            bank_address_to_index[bank_address] = bank_index;
-            banks.push_back(bank);
+        auto [it, added] = bank_address_to_index.try_emplace(bank_address, bank_index);
+        if (added) {
+            banks.emplace_back(bank_index, data.subspan(bank_address, bank_size));
             bank_index++;
         }
 
-        for (auto &bank : banks) {
-            if (bank.bank_index == bank_address_to_index[bank_address]) {
-                bank.ctl_indices.push_back(tbl_index);
-            }
-        }
+        // bank_index is also the bank's position in banks
+        banks[it->second].ctl_indices.push_back(tbl_index);
     }
 
     return banks;
 }
 
-int write_table(const string &filename) {
+string table_filename(const string &filename) {
+    return regex_replace(filename, regex("aiff"), "table");
+}
+
+int write_table(const string &filename, const ArtifactCache &cache, Manifest &manifest,
+                const TableDesignParams &params, ThreadPool &pool) {
     // Load aiff
-    byte i;
-    vector<byte> aiff;
-    auto aiffFile = ifstream(filename, ios::binary);
+    auto aiffFile = MappedFile(filename);
     if (!aiffFile) {
         cerr << "Failed to open: " << filename << "!" << endl;
         return 5;
     }
-    while (aiffFile.read(reinterpret_cast<char *>(&i), sizeof(i))) {
-        aiff.emplace_back(i);
+
+    // The table only depends on the .aiff and how it's designed, so an unchanged one keeps its table
+    auto tableFilename = table_filename(filename);
+    CacheKey key;
+    key.add(as_bytes(span("aiff table", 10)));
+    key.add_value(OUTPUT_VERSION);
+    for (size_t param : { params.order, params.bits, params.refineIters }) {
+        key.add_value(param);
+    }
+    key.add(aiffFile.bytes());
+    if (manifest.up_to_date(tableFilename, key)) {
+        return 0;
     }
 
     // Write table
-    auto tableFilename = regex_replace(filename, regex("aiff"), "table");
     auto tableFile = ofstream(tableFilename);
     if (!tableFile) {
         cerr << "Failed to open: " << tableFilename << "!" << endl;
         return 6;
     }
-    auto ret = write_codebook(aiff, tableFile);
-    if (!ret) {
-        return 0;
+    auto ret = write_codebook(aiffFile.bytes(), tableFile);
+    if (ret) {
+        ret = write_tabledesign_codebook(filename, tableFile, cache, params, pool);
     }
-    ret = write_tabledesign_codebook(filename, tableFile);
     if (ret) {
         cerr << "Failed to write codebook!" << endl;
+        unlink(tableFilename.c_str());
         return 7;
     }
+    // Both writers close the file, which leaves it failed if any of the table didn't make it out
+    if (!tableFile) {
+        cerr << "Failed to write: " << tableFilename << "!" << endl;
+        unlink(tableFilename.c_str());
+        return 8;
+    }
+    manifest.record(tableFilename, key);
 
     return 0;
 }
 
-int extract_tables(void) {
+// Lists every .aiff file below `root`. Each level of the tree is listed across the pool, one directory
+// per task, and the result is sorted so that it doesn't depend on which thread saw what first.
+// Directories that can't be read are reported and skipped; symlinked ones are not followed.
+vector<fs::directory_entry> find_aiffs(const fs::path &root, ThreadPool &pool) {
     const string extension = ".aiff";
-    // TODO: pass path from other game code
-    for (auto &path : fs::recursive_directory_iterator(fs::current_path())) {
-        if (path.path().extension() == extension) {
-            auto ret = write_table(path.path().string());
-            if (ret) {
-                return ret;
+    vector<fs::directory_entry> found;
+    vector<fs::path> level;
+    if (fs::is_directory(root)) {
+        level.push_back(root);
+    }
+
+    while (!level.empty()) {
+        vector<vector<fs::path>> subdirs(level.size());
+        vector<vector<fs::directory_entry>> files(level.size());
+        pool.parallel_for(level.size(), [&](size_t i) {
+            error_code err, status_err;
+            for (auto it = fs::directory_iterator(level[i], err);
+                 !err && it != fs::directory_iterator(); it.increment(err)) {
+                if (it->is_directory(status_err) && !it->is_symlink(status_err)) {
+                    subdirs[i].push_back(it->path());
+                } else if (it->path().extension() == extension) {
+                    files[i].push_back(*it);
+                }
             }
+            if (err) {
+                cerr << "Failed to read directory: " << level[i].string() << ": " << err.message()
+                     << endl;
+            }
+        });
+
+        level.clear();
+        for (size_t i = 0; i < subdirs.size(); i++) {
+            level.insert(level.end(), subdirs[i].begin(), subdirs[i].end());
+            found.insert(found.end(), files[i].begin(), files[i].end());
         }
     }
 
-    return 0;
+    sort(found.begin(), found.end(), [](const fs::directory_entry &a, const fs::directory_entry &b) {
+        return a.path() < b.path();
+    });
+    return found;
 }
 
-int write_aiff(const AifcEntry &entry) {
-    string filename = entry.filename;
+// `extracted` lists the .aiff files extract_aiffs() already wrote a table for, straight from the ROM's
+// codebook, so only the extended soundbank's own .aiff files are read back here. Every file is
+// attempted even when some fail; failures are listed in path order and the first one's code returned.
+int extract_tables(const fs::path &root, const set<fs::path> &extracted, ThreadPool &pool,
+                   const ArtifactCache &cache, Manifest &manifest, const TableDesignParams &params) {
+    vector<fs::directory_entry> aiffs;
+    for (auto &entry : find_aiffs(root, pool)) {
+        if (!extracted.count(entry.path().lexically_normal())) {
+            aiffs.push_back(move(entry));
+        }
+    }
 
-    error_code err;
-    if (!fs::create_directories(fs::path(filename).parent_path(), err)
-        && !fs::exists(fs::path(filename).parent_path())) {
-        cerr << "Failed to create directory for: " << filename << ": " << err.message() << endl;
-        return 3;
+    // Largest first, the same as the samples in extract_aiffs()
+    vector<uintmax_t> sizes(aiffs.size());
+    for (size_t i = 0; i < aiffs.size(); i++) {
+        error_code err;
+        sizes[i] = aiffs[i].file_size(err);
+        if (err) {
+            sizes[i] = 0;
+        }
     }
-    auto file = ofstream(filename, ios::binary);
-    if (!file) {
-        cerr << "Failed to open: " << filename << "!" << endl;
-        return 4;
+    vector<size_t> schedule(aiffs.size());
+    iota(schedule.begin(), schedule.end(), 0);
+    stable_sort(schedule.begin(), schedule.end(),
+                [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    vector<int> results(aiffs.size());
+    pool.parallel_for(schedule.size(), [&](size_t i) {
+        size_t aiff = schedule[i];
+        results[aiff] = write_table(aiffs[aiff].path().string(), cache, manifest, params, pool);
+    });
+
+    int ret = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < aiffs.size(); i++) {
+        if (!results[i]) {
+            continue;
+        }
+        cerr << aiffs[i].path().string() << ": no table written (error " << results[i] << ")" << endl;
+        if (!failed++) {
+            ret = results[i];
+        }
+    }
+    if (failed) {
+        cerr << failed << " of " << aiffs.size() << " table(s) could not be written" << endl;
     }
-    auto writer = AiffWriter(file);
-    writer.write(entry);
 
-    return 0;
+    return ret;
 }
 
-int extract_aiffs(const vector<byte> &rom, map<const string, const vector<uint32_t>> &seqfile_map,
-                  map<const uint32_t, const string> &address_to_filename) {
-    auto ctl_metadata = seqfile_map["ctl"], tbl_metadata = seqfile_map["tbl"];
-    auto ctl_size = ctl_metadata[0], ctl_offset = ctl_metadata[1];
-    auto tbl_size = tbl_metadata[0], tbl_offset = tbl_metadata[1];
-    auto ctl_data = vector<byte>(rom.begin() + ctl_offset, rom.begin() + ctl_offset + ctl_size);
-    auto tbl_data = vector<byte>(rom.begin() + tbl_offset, rom.begin() + tbl_offset + tbl_size);
+int write_aiff(const AifcEntry &entry, ThreadPool &pool, const RoundtripBudget &budget,
+               const ArtifactCache &cache, Manifest &manifest,
+               vector<pair<size_t, RoundtripResult>> &fallbacks) {
+    CacheKey tableKey;
+    tableKey.add(as_bytes(span("book table", 10)));
+    tableKey.add_value(OUTPUT_VERSION);
+    tableKey.add_value(entry.book.order);
+    tableKey.add_value(entry.book.npredictors);
+    tableKey.add(as_bytes(span(entry.book.table)));
+
+    auto writer = AiffWriter(entry, pool, budget, cache, fallbacks);
+    for (const auto &name : entry.names) {
+        const string &filename = name.filename;
+        auto tableFilename = table_filename(filename);
+        CacheKey key = AiffWriter::key(entry, name);
+        bool aiffCurrent = manifest.up_to_date(filename, key);
+        bool tableCurrent = manifest.up_to_date(tableFilename, tableKey);
+        if (aiffCurrent && tableCurrent) {
+            continue;
+        }
+
+        error_code err;
+        if (!fs::create_directories(fs::path(filename).parent_path(), err)
+            && !fs::exists(fs::path(filename).parent_path())) {
+            cerr << "Failed to create directory for: " << filename << ": " << err.message() << endl;
+            return 3;
+        }
+
+        if (!aiffCurrent) {
+            int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
+                cerr << "Failed to open: " << filename << "!" << endl;
+                return 4;
+            }
+            int write_err = writer.write(fd, name, key);
+            if (close(fd) != 0 && !write_err) {
+                write_err = errno;
+            }
+            if (write_err) {
+                // Nothing is recorded for it, and a partial file isn't left behind either
+                cerr << "Failed to write: " << filename << ": " << strerror(write_err) << endl;
+                unlink(filename.c_str());
+                return 5;
+            }
+            // Frames that needed the fallback search are decoded again next time, and reported again
+            if (!writer.needed_fallbacks()) {
+                manifest.record(filename, key);
+            }
+        }
+
+        if (!tableCurrent) {
+            // The codebook is already in memory, so the table doesn't have to come from reading the
+            // .aiff back
+            auto tableFile = ofstream(tableFilename);
+            if (!tableFile) {
+                cerr << "Failed to open: " << tableFilename << "!" << endl;
+                return 6;
+            }
+            write_codebook_table(entry.book.codebook, tableFile);
+            tableFile.close();
+            if (!tableFile) {
+                // Same as for the .aiff: nothing recorded, no partial file left behind
+                cerr << "Failed to write: " << tableFilename << "!" << endl;
+                unlink(tableFilename.c_str());
+                return 7;
+            }
+            manifest.record(tableFilename, tableKey);
+        }
+    }
+
+    return 0;
+}
 
+// Parses every bank of the ctl/tbl seqfiles, registering the samples their instruments and drums play
+vector<SampleBank> parse_banks(span<const byte> ctl_data, span<const byte> tbl_data,
+                               const AddressTable &address_to_filename, SampleRegistry &registry) {
     // ctl_entries and tbl_entries contain elements that were matched to each other sequentially
     // in the order they sit in their respective arrays i.e. each SampleBank needs to hold information
     // identifying what the index was of each tbl_entries element that contained a reference to it,
@@ -2363,43 +4445,121 @@ int extract_aiffs(const vector<byte> &rom, map<const string, const vector<uint32
 
     auto banks = parse_tbl(tbl_data, tbl_entries);
 
+    // Every ctl entry belongs to exactly one bank, so the bank is looked up by ctl index rather than
+    // searched for in every bank's ctl_indices
+    vector<SampleBank *> ctl_banks(ctl_entries.size(), nullptr);
+    CtlScratch scratch;
+    for (auto &bank : banks) {
+        for (auto ctl_index : bank.ctl_indices) {
+            ctl_banks[ctl_index] = &bank;
+        }
+    }
+
     for (size_t ctl_index = 0; ctl_index < ctl_entries.size(); ctl_index++) {
-        for (auto &bank : banks) {
-            if (find(bank.ctl_indices.begin(), bank.ctl_indices.end(), ctl_index)
-                == bank.ctl_indices.end()) {
-                // here, the ctl_index is not in the ctl_indices list of the sample bank, so this sample
-                // bank is not associated with this ctl_entries element This will match a single sample
-                // bank only within this inner loop, but the same sample bank will be used multiple
-                // times by the outer loop over all the ctl_entries, one bank for each ctl_entry
-                // element, but each bank has its parse_ctl() method called multiple times, populating
-                // it
-                continue;
-            }
-            uint32_t offset = ctl_entries[ctl_index].first, length = ctl_entries[ctl_index].second;
-            auto entry = vector<byte>(ctl_data.begin() + offset, ctl_data.begin() + offset + length);
-            auto header = BankHeader(vector<byte>(entry.begin(), entry.begin() + 16));
-            bank.parse_ctl(header, vector<byte>(entry.begin() + 16, entry.end()), address_to_filename,
-                           offset);
+        // A bank's parse_ctl() is called once for each ctl entry assigned to it, populating it
+        // with the samples of each
+        assert(ctl_banks[ctl_index] != nullptr);
+        uint32_t offset = ctl_entries[ctl_index].first, length = ctl_entries[ctl_index].second;
+        auto entry = ctl_data.subspan(offset, length);
+        auto header = BankHeader(entry.first(16));
+        ctl_banks[ctl_index]->parse_ctl(header, entry.subspan(16), address_to_filename, offset,
+                                        registry, scratch);
+    }
+
+    return banks;
+}
+
+int extract_aiffs(span<const byte> rom, const RomAsset &ctl_seqfile, const RomAsset &tbl_seqfile,
+                  const AddressTable &address_to_filename, ThreadPool &pool,
+                  const RoundtripBudget &budget, const ArtifactCache &cache, Manifest &manifest,
+                  set<fs::path> &extracted) {
+    auto ctl_size = ctl_seqfile.size, ctl_offset = ctl_seqfile.offset;
+    auto tbl_size = tbl_seqfile.size, tbl_offset = tbl_seqfile.offset;
+    if (static_cast<size_t>(ctl_offset) + ctl_size > rom.size()
+        || static_cast<size_t>(tbl_offset) + tbl_size > rom.size()) {
+        cerr << "ROM is too small to contain the sound data!" << endl;
+        return 1;
+    }
+    auto ctl_data = rom.subspan(ctl_offset, ctl_size);
+    auto tbl_data = rom.subspan(tbl_offset, tbl_size);
+
+    // Banks that share a sample all register it here, so each payload is decoded once however many
+    // banks or names refer to it
+    SampleRegistry registry;
+    parse_banks(ctl_data, tbl_data, address_to_filename, registry);
+
+    // Every sample decodes independently, so they are all handed to the pool at once. The biggest
+    // payloads go first so that a long instrument sample never ends up starting last and holding up
+    // the whole stage; results are still reported in the order the samples were found. Samples that
+    // no name refers to have nothing to be written to.
+    vector<const AifcEntry *> samples;
+    for (const auto &sample : registry.samples) {
+        if (!sample.names.empty()) {
+            samples.push_back(&sample);
         }
     }
 
-    for (auto &bank : banks) {
-        for (const auto &sample : bank.entries) {
-            auto ret = write_aiff(sample);
-            if (ret) {
-                return ret;
+    vector<size_t> schedule(samples.size());
+    iota(schedule.begin(), schedule.end(), 0);
+    stable_sort(schedule.begin(), schedule.end(), [&samples](size_t a, size_t b) {
+        return samples[a]->data.size() > samples[b]->data.size();
+    });
+
+    vector<int> results(samples.size());
+    vector<vector<pair<size_t, RoundtripResult>>> fallbacks(samples.size());
+    pool.parallel_for(schedule.size(), [&](size_t i) {
+        results[schedule[i]] = write_aiff(*samples[schedule[i]], pool, budget, cache, manifest,
+                                          fallbacks[schedule[i]]);
+    });
+
+    // Frames the solver couldn't settle are listed so that slow or lossy samples can be tracked down
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (fallbacks[i].empty()) {
+            continue;
+        }
+        cerr << samples[i]->names[0].filename << ": " << fallbacks[i].size()
+             << " frame(s) needed the fallback search:";
+        for (const auto &[frame, result] : fallbacks[i]) {
+            cerr << " " << frame << " (" << roundtrip_result_name(result) << ")";
+        }
+        cerr << endl;
+    }
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (!results[i]) {
+            for (const auto &name : samples[i]->names) {
+                extracted.insert(fs::absolute(name.filename).lexically_normal());
             }
         }
     }
 
+    for (auto ret : results) {
+        if (ret) {
+            return ret;
+        }
+    }
+
     return 0;
 }
 
-int extract_m64s(const vector<byte> &rom, map<const string, const vector<uint32_t>> &sequence_map) {
-    for (const auto &[asset, addresses] : sequence_map) {
-        uint32_t size = addresses[0], pos = addresses[1];
+int extract_m64s(span<const byte> rom, span<const RomAsset> sequences, Manifest &manifest) {
+    for (const auto &sequence : sequences) {
+        auto asset = string(sequence.filename);
+        uint32_t size = sequence.size, pos = sequence.offset;
+        if (static_cast<size_t>(pos) + size > rom.size()) {
+            cerr << "ROM is too small to contain " << asset << "!" << endl;
+            return 1;
+        }
+
+        auto input = rom.subspan(pos, size);
+        CacheKey key;
+        key.add(as_bytes(span("m64", 3)));
+        key.add_value(OUTPUT_VERSION);
+        key.add(input);
+        if (manifest.up_to_date(asset, key)) {
+            continue;
+        }
 
-        auto input = vector<byte>(rom.begin() + pos, rom.begin() + pos + size);
         error_code err;
         if (!fs::create_directories(fs::path(asset).parent_path(), err)
             && !fs::exists(fs::path(asset).parent_path())) {
@@ -2412,51 +4572,494 @@ int extract_m64s(const vector<byte> &rom, map<const string, const vector<uint32_
             return 2;
         }
         out.write(reinterpret_cast<const char *>(input.data()), input.size());
+        out.close();
+        manifest.record(asset, key);
     }
 
     return 0;
 }
 
+// Self-test
+// Checks run by --self-test instead of an extraction. Each returns whether it passed and reports what
+// went wrong on cerr.
+
+// operator new calls are counted while `count_allocations` is set, which only the self-test does.
+// operator delete stays the library's, which frees malloc()ed memory.
+atomic<bool> count_allocations = false;
+atomic<size_t> allocations = 0;
+
+void *operator new(size_t size) {
+    if (count_allocations.load(memory_order_relaxed)) {
+        allocations.fetch_add(1, memory_order_relaxed);
+    }
+    if (void *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw bad_alloc();
+}
+
+// FrameEnumeration visits every frame exactly once, at its distance: with two values for each sample,
+// that's 16 choose d frames at distance d. The input names a predictor the book doesn't have, so no
+// frame ever matches and every level is searched in full.
+bool self_test_enumeration(void) {
+    s16 coefficients[2 * 8] = {};
+    Codebook book(2, 1, coefficients);
+    u8 input[9] = { 0x01 };
+    s32 lastState[16] = {};
+    s16 guess[16];
+    RoundtripBudget budget;
+    budget.tries = numeric_limits<u64>::max();
+
+    FrameEnumeration search{ input, lastState, guess, book, SearchBudget(budget), {}, {}, {} };
+    for (s32 i = 15; i >= 0; i--) {
+        search.ladder[i][0] = guess[i] = 0;
+        search.ladder[i][1] = 1;
+        search.rungs[i] = 2;
+        search.capacity[i] = search.capacity[i + 1] + 1;
+    }
+
+    u64 expected = 1;
+    for (s32 distance = 0; distance <= 16; distance++) {
+        u64 before = search.budget.remaining();
+        if (search.visit(0, distance)) {
+            cerr << "self_test_enumeration(): a frame matched at distance " << distance << endl;
+            return false;
+        }
+        u64 leaves = before - search.budget.remaining();
+        if (leaves != expected) {
+            cerr << "self_test_enumeration(): " << leaves << " frames at distance " << distance
+                 << ", expected " << expected << endl;
+            return false;
+        }
+        expected = expected * (16 - distance) / (distance + 1);
+    }
+    return true;
+}
+
+s32 random_in(u64 *rng, s32 lo, s32 hi) {
+    return lo + myrand(rng) % (hi - lo + 1);
+}
+
+// A book for the encoder checks: mostly order 2, 1-8 predictors, and now and then coefficients at
+// the edge of the s16 range or a predictor that repeats another, which tests the encoder's tie-break
+Codebook random_book(u64 *rng) {
+    s32 order = random_in(rng, 0, 3) ? 2 : random_in(rng, 1, 8), npredictors = random_in(rng, 1, 8);
+    s32 range = random_in(rng, 0, 7) ? 4096 : 0x7fff;
+    vector<s16> coefficients(npredictors * order * 8);
+    for (auto &c : coefficients) {
+        c = random_in(rng, -range, range);
+    }
+    if (npredictors > 1 && random_in(rng, 0, 3) == 0) {
+        s32 from = random_in(rng, 0, npredictors - 1), to = random_in(rng, 0, npredictors - 1);
+        copy_n(&coefficients[from * order * 8], order * 8, &coefficients[to * order * 8]);
+    }
+    return Codebook(order, npredictors, coefficients.data());
+}
+
+// encodes_to() accepts a frame exactly when my_encodeframe() produces it, with every kernel set this
+// CPU runs. Each random book, state and guess is checked against its own encoding and against copies
+// with one nibble, the scale or the predictor changed. Some books repeat a predictor, so that the
+// encoder's tie-break is tested, and half the guesses are decodes of a random frame, which land close
+// to a match far more often than noise does.
+bool self_test_encodes_to(void) {
+    const u64 TRIALS = 100000;
+    const AdpcmKernels *selected = adpcm_kernels;
+    u64 rng = myrand_seed(0);
+    auto random = [&rng](s32 lo, s32 hi) {
+        return random_in(&rng, lo, hi);
+    };
+
+    bool passed = true;
+    for (const char *name : { "scalar", "sse4.1", "avx2" }) {
+        adpcm_kernels = select_kernels(name);
+        if (adpcm_kernels == nullptr) {
+            continue;
+        }
+
+        for (u64 trial = 0; trial < TRIALS && passed; trial++) {
+            Codebook book = random_book(&rng);
+            s32 order = book.order, npredictors = book.npredictors;
+
+            s32 lastState[16], state[16];
+            s32 amplitude = 1 << random(0, 15);
+            for (auto &v : lastState) {
+                v = random(-amplitude, amplitude - 1);
+            }
+
+            s16 guess[16];
+            if (random(0, 1)) {
+                u8 frame[9];
+                for (auto &b : frame) {
+                    b = random(0, 255);
+                }
+                frame[0] = (random(0, 12) << 4) | random(0, npredictors - 1);
+                copy(lastState, lastState + 16, state);
+                my_decodeframe(frame, state, book);
+                for (s32 i = 0; i < 16; i++) {
+                    guess[i] = clamp_to_s16(state[i]);
+                }
+            } else {
+                amplitude = 1 << random(0, 15);
+                for (auto &v : guess) {
+                    v = random(-amplitude, amplitude - 1);
+                }
+            }
+
+            u8 encoded[9];
+            s16 input[16];
+            copy(lastState, lastState + 16, state);
+            copy(guess, guess + 16, input);
+            my_encodeframe(encoded, input, state, book);
+
+            u8 targets[4][9];
+            for (auto &target : targets) {
+                memcpy(target, encoded, 9);
+            }
+            s32 nibble = random(2, 17);
+            targets[1][nibble / 2] ^= (nibble % 2 ? 0x0f : 0xf0) & random(1, 255);
+            targets[2][0] = (((encoded[0] >> 4) + random(1, 15)) % 16 << 4) | (encoded[0] & 0xf);
+            targets[3][0] = (encoded[0] & 0xf0) | random(0, 15);
+
+            for (const auto &target : targets) {
+                bool expected = memcmp(target, encoded, 9) == 0;
+                if (encodes_to(target, guess, lastState, book) != expected) {
+                    cerr << "self_test_encodes_to(): " << name << " kernels "
+                         << (expected ? "rejected" : "accepted") << " a frame in trial " << trial
+                         << " (order " << order << ", " << npredictors << " predictors)" << endl;
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    adpcm_kernels = selected;
+    return passed;
+}
+
+// encode_matches() and every width of encode_lanes_matches() set exactly the bits of the candidates
+// encodes_to() accepts, and none past `count`, for batches of 2 to 16 that fill their lanes or only
+// part of them. The candidates are a decoded frame and copies of it nudged by a few steps, many of
+// which still encode to the same frame, mixed with noise that doesn't.
+bool self_test_encode_matches(void) {
+    const u64 TRIALS = 30000;
+    const AdpcmKernels *selected = adpcm_kernels;
+    u64 rng = myrand_seed(1);
+    auto random = [&rng](s32 lo, s32 hi) {
+        return random_in(&rng, lo, hi);
+    };
+
+    bool passed = true;
+    for (const char *name : { "scalar", "sse4.1", "avx2" }) {
+        adpcm_kernels = select_kernels(name);
+        if (adpcm_kernels == nullptr) {
+            continue;
+        }
+
+        for (u64 trial = 0; trial < TRIALS && passed; trial++) {
+            s32 count = 2 + trial % (ENCODE_LANES - 1);
+            Codebook book = random_book(&rng);
+
+            s32 lastState[16], state[16];
+            s32 amplitude = 1 << random(0, 15);
+            for (auto &v : lastState) {
+                v = random(-amplitude, amplitude - 1);
+            }
+
+            u8 input[9];
+            for (auto &b : input) {
+                b = random(0, 255);
+            }
+            input[0] = (random(0, 12) << 4) | random(0, book.npredictors - 1);
+            copy(lastState, lastState + 16, state);
+            my_decodeframe(input, state, book);
+
+            s16 candidates[ENCODE_LANES][16];
+            u32 expected = 0;
+            for (s32 l = 0; l < count; l++) {
+                for (s32 i = 0; i < 16; i++) {
+                    candidates[l][i] = clamp_to_s16(state[i]);
+                }
+                if (random(0, 3) == 0) {
+                    for (auto &v : candidates[l]) {
+                        v = random(-0x8000, 0x7fff);
+                    }
+                } else {
+                    for (s32 changes = random(0, 2); changes > 0; changes--) {
+                        s16 &v = candidates[l][random(0, 15)];
+                        v = clamp_to_s16(v + random(-3, 3));
+                    }
+                }
+                expected |= static_cast<u32>(encodes_to(input, candidates[l], lastState, book)) << l;
+            }
+
+            // the narrower widths only take batches that fit
+            pair<const char *, u32> masks[] = {
+                { "encode_matches", encode_matches(input, candidates, count, lastState, book) },
+                { "4 lanes", expected },
+                { "8 lanes", expected },
+                { "16 lanes", encode_lanes_matches<16>(input, candidates, count, lastState, book) },
+            };
+            if (count <= 4) {
+                masks[1].second = encode_lanes_matches<4>(input, candidates, count, lastState, book);
+            }
+            if (count <= 8) {
+                masks[2].second = encode_lanes_matches<8>(input, candidates, count, lastState, book);
+            }
+            for (auto [width, mask] : masks) {
+                if (mask != expected) {
+                    cerr << "self_test_encode_matches(): " << name << " kernels, " << width << ": mask "
+                         << hex << mask << " for " << count << " candidates, encodes_to() gives "
+                         << expected << dec << " in trial " << trial << endl;
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    adpcm_kernels = selected;
+    return passed;
+}
+
+// ctl/tbl seqfiles with `ctlEntries` ctl entries, two to each tbl bank. Each entry has `sounds`
+// instruments, whose samples lie in its bank at the same places as the other entry's, with the same
+// book, so the two entries of a bank share their samples.
+void synthetic_seqfiles(uint32_t ctlEntries, uint32_t sounds, vector<byte> &ctl, vector<byte> &tbl) {
+    auto put32 = [](vector<byte> &out, size_t at, uint32_t value) {
+        out.resize(max(out.size(), at + 4));
+        for (size_t i = 0; i < 4; i++) {
+            out[at + i] = static_cast<byte>(value >> (24 - 8 * i));
+        }
+    };
+    const uint32_t payload = 18 * sounds;
+    // bank data layout: drum list, instrument list, instruments, samples, book, loop
+    const uint32_t instruments = 4 + 4 * sounds, samples = instruments + 32 * sounds,
+                   book = samples + 20 * sounds, loop = book + 72, bankSize = 16 + loop + 16;
+    u64 rng = myrand_seed(ctlEntries);
+
+    ctl.clear();
+    tbl.clear();
+    put32(ctl, 0, TYPE_CTL << 16 | ctlEntries);
+    put32(tbl, 0, TYPE_TBL << 16 | ctlEntries);
+    uint32_t start = align(4 + ctlEntries * 8, 16);
+    for (uint32_t entry = 0; entry < ctlEntries; entry++) {
+        uint32_t ctlOffset = start + entry * bankSize, tblOffset = start + entry / 2 * payload;
+        put32(ctl, 4 + entry * 8, ctlOffset);
+        put32(ctl, 8 + entry * 8, bankSize);
+        put32(tbl, 4 + entry * 8, tblOffset);
+        put32(tbl, 8 + entry * 8, payload);
+        if (entry % 2 == 0) {
+            tbl.resize(tblOffset + payload);
+            for (uint32_t i = 0; i < payload; i++) {
+                tbl[tblOffset + i] = static_cast<byte>(myrand(&rng));
+            }
+        }
+
+        put32(ctl, ctlOffset, sounds);
+        put32(ctl, ctlOffset + 4, 0);
+        put32(ctl, ctlOffset + 8, 0);
+        put32(ctl, ctlOffset + 12, 0);
+        uint32_t data = ctlOffset + 16;
+        put32(ctl, data, 0);
+        for (uint32_t sound = 0; sound < sounds; sound++) {
+            uint32_t instrument = instruments + 32 * sound, sample = samples + 20 * sound;
+            put32(ctl, data + 4 + 4 * sound, instrument);
+            // normal range 0-127 with an envelope, only sound_med is used
+            put32(ctl, data + instrument, 0x00007f00);
+            put32(ctl, data + instrument + 4, 1);
+            put32(ctl, data + instrument + 16, sample);
+            put32(ctl, data + instrument + 20, bit_cast<uint32_t>(1.0f));
+            put32(ctl, data + instrument + 24, 0);
+            put32(ctl, data + instrument + 28, 0);
+            put32(ctl, data + sample, 0);
+            put32(ctl, data + sample + 4, 18 * sound);
+            put32(ctl, data + sample + 8, loop);
+            put32(ctl, data + sample + 12, book);
+            put32(ctl, data + sample + 16, 18);
+        }
+        put32(ctl, data + book, 2);
+        put32(ctl, data + book + 4, 2);
+        for (uint32_t i = 0; i < 64; i += 4) {
+            put32(ctl, data + book + 8 + i, 0x01000100 * (i + 1));
+        }
+        put32(ctl, data + loop + 12, 0);
+    }
+}
+
+// parse_banks() on synthetic seqfiles of 250, 1000 and 4000 ctl entries with 16 sounds each. Every
+// bank has to come out with its two ctl entries and 16 samples, and every sample is registered once.
+// Only what is kept may allocate: five allocations a sample (payload, book table, expanded codebook,
+// registry entry and bank entry), at most 16 for each bank's own containers, and 64 for the
+// containers spanning all banks to grow into. The time per entry is printed, which stays flat as
+// long as the parse scales linearly.
+bool self_test_parse_banks(void) {
+    static constexpr SampleAsset no_samples[] = { { 0, "" } };
+    static constexpr auto no_slots = AddressTable::build(no_samples);
+    const AddressTable no_filenames(no_samples, no_slots);
+    const uint32_t sounds = 16;
+
+    for (uint32_t entries : { 250, 1000, 4000 }) {
+        vector<byte> ctl, tbl;
+        synthetic_seqfiles(entries, sounds, ctl, tbl);
+
+        SampleRegistry registry;
+        allocations = 0;
+        count_allocations = true;
+        auto start = chrono::steady_clock::now();
+        auto banks = parse_banks(ctl, tbl, no_filenames, registry);
+        chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+        count_allocations = false;
+
+        bool parsed = banks.size() == entries / 2 && registry.samples.size() == entries / 2 * sounds;
+        for (uint32_t i = 0; parsed && i < banks.size(); i++) {
+            parsed = banks[i].ctl_indices == vector<uint32_t>{ 2 * i, 2 * i + 1 }
+                     && banks[i].samples.size() == sounds;
+        }
+        if (!parsed) {
+            cerr << "self_test_parse_banks(): " << entries << " ctl entries came out as "
+                 << banks.size() << " banks with " << registry.samples.size() << " samples" << endl;
+            return false;
+        }
+        size_t bound = 5 * registry.samples.size() + 16 * banks.size() + 64;
+        if (allocations > bound) {
+            cerr << "self_test_parse_banks(): " << entries << " ctl entries took " << allocations
+                 << " allocations, more than " << bound << endl;
+            return false;
+        }
+        cout << "parse_banks: " << entries << " ctl entries in " << elapsed.count() / 1000 << " ms, "
+             << elapsed.count() / entries << " us per entry, " << allocations << " allocations" << endl;
+    }
+    return true;
+}
+
+int self_test(void) {
+    const pair<const char *, bool (*)(void)> checks[] = {
+        { "enumeration", self_test_enumeration },
+        { "encodes_to", self_test_encodes_to },
+        { "encode_matches", self_test_encode_matches },
+        { "parse_banks", self_test_parse_banks },
+    };
+
+    int failed = 0;
+    for (auto [name, check] : checks) {
+        bool passed = check();
+        cout << name << ": " << (passed ? "ok" : "FAILED") << endl;
+        failed += !passed;
+    }
+    return failed ? 1 : 0;
+}
+// End self-test
+
 // to easily import and run this tool from a larger C++ program, main() can be renamed and called from
 // an appropriate point in the larger program to extract the sound asset tree from a ROM in the current
 // working directory or a directory provided by a path argument in a modified function signature.
-int main(void) {
+int main(int argc, char **argv) {
     string rom_filename = "baserom.us.z64";
+    unsigned jobs = max(thread::hardware_concurrency(), 1u);
+    RoundtripBudget budget;
+    TableDesignParams tableParams;
+    fs::path cache_dir = default_cache_dir();
+    uintmax_t cache_size = 512;
+    bool force = false, selfTest = false;
+
+    for (int arg = 1; arg < argc; arg++) {
+        bool valid = arg + 1 < argc;
+        if (strcmp(argv[arg], "--no-cache") == 0) {
+            cache_dir.clear();
+            valid = true;
+        } else if (strcmp(argv[arg], "--force") == 0) {
+            force = true;
+            valid = true;
+        } else if (strcmp(argv[arg], "--self-test") == 0) {
+            selfTest = true;
+            valid = true;
+        } else if (strcmp(argv[arg], "--stream-tables") == 0) {
+            tableParams.streaming = true;
+            valid = true;
+        } else if (valid && strcmp(argv[arg], "--cache-dir") == 0) {
+            cache_dir = argv[++arg];
+        } else if (valid && strcmp(argv[arg], "--cache-size") == 0) {
+            cache_size = strtoull(argv[++arg], nullptr, 10);
+            valid = cache_size > 0;
+        } else if (valid && (strcmp(argv[arg], "--jobs") == 0 || strcmp(argv[arg], "-j") == 0)) {
+            jobs = strtoul(argv[++arg], nullptr, 10);
+            valid = jobs > 0;
+        } else if (valid && strcmp(argv[arg], "--frame-tries") == 0) {
+            budget.tries = strtoull(argv[++arg], nullptr, 10);
+            valid = budget.tries > 0;
+        } else if (valid && strcmp(argv[arg], "--frame-time") == 0) {
+            budget.time = chrono::milliseconds(strtoull(argv[++arg], nullptr, 10));
+        } else if (valid && strcmp(argv[arg], "--table-order") == 0) {
+            tableParams.order = strtoull(argv[++arg], nullptr, 10);
+            valid = tableParams.order >= 1 && tableParams.order <= 8;
+        } else if (valid && strcmp(argv[arg], "--table-bits") == 0) {
+            // a frame header has 4 bits for its predictor
+            tableParams.bits = strtoull(argv[++arg], nullptr, 10);
+            valid = tableParams.bits <= 4;
+        } else if (valid && strcmp(argv[arg], "--table-iters") == 0) {
+            tableParams.refineIters = strtoull(argv[++arg], nullptr, 10);
+            valid = tableParams.refineIters > 0;
+        } else if (valid && strcmp(argv[arg], "--kernels") == 0) {
+            adpcm_kernels = select_kernels(argv[++arg]);
+            valid = adpcm_kernels != nullptr;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            cerr << "Usage: " << argv[0]
+                 << " [--jobs N] [--frame-tries N] [--frame-time MS] [--kernels scalar|sse4.1|avx2]"
+                 << " [--cache-dir DIR] [--cache-size MB] [--no-cache] [--force] [--stream-tables]"
+                 << " [--table-order N] [--table-bits N] [--table-iters N] [--self-test]" << endl;
+            return 1;
+        }
+    }
+
+    if (selfTest) {
+        return self_test();
+    }
 
     // Load ROM
-    byte i;
-    vector<byte> rom;
-    auto file = ifstream(rom_filename, ios::binary);
+    auto file = MappedFile(rom_filename);
     if (!file) {
         cerr << "Failed to open " << rom_filename << "!" << endl;
         return 1;
     }
-    while (file.read(reinterpret_cast<char *>(&i), sizeof(i))) {
-        rom.emplace_back(i);
-    }
+    auto rom = file.bytes();
+
+    // Outputs whose inputs haven't changed since the last run are left untouched, unless --force
+    auto manifest = Manifest("sound/.extract_sounds.manifest", force);
 
     // Extract .m64 files
-    auto ret = extract_m64s(rom, sequence_map);
+    auto ret = extract_m64s(rom, sequence_map, manifest);
     if (ret) {
         cerr << "Failed to extract all m64s!" << endl;
         return ret;
     }
 
     // Extract .aiff files
-    ret = extract_aiffs(rom, seqfile_map, sample_map);
+    auto pool = ThreadPool(jobs);
+    auto cache = ArtifactCache(cache_dir, cache_size << 20);
+    set<fs::path> extracted;
+    ret = extract_aiffs(rom, ctl_seqfile, tbl_seqfile, sample_map, pool, budget, cache, manifest,
+                        extracted);
     if (ret) {
         cerr << "Failed to extract all aiffs!" << endl;
         return ret;
     }
 
-    // Extract .table files from all detected .aiff files
-    // this includes all extended soundbank .aiff files,
+    // Extract .table files from all other .aiff files under sound/samples
+    // these are the extended soundbank .aiff files,
     // which are external assets separate from the ROM
-    ret = extract_tables();
+    ret = extract_tables(fs::current_path() / "sound" / "samples", extracted, pool, cache, manifest,
+                         tableParams);
+    cache.trim();
     if (ret) {
         cerr << "Failed to extract all tables!" << endl;
-        return ret;
     }
 
-    return 0;
+    // Saved even when some tables failed, so everything that did succeed is kept next time
+    if (manifest.save() && !ret) {
+        ret = 1;
+    }
+
+    return ret;
 }
\ No newline at end of file